@@ -0,0 +1,234 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "actions.h"
+#include "log.h"
+#include "privileges.h"
+
+
+#define MAX_ACTIONS (16)
+#define MAX_COMMAND_SIZE (256)
+
+
+typedef enum {
+    TRIGGER_TIME,
+    TRIGGER_BATTERY,
+    TRIGGER_LOAD
+}
+action_trigger;
+
+
+typedef struct {
+    action_trigger trigger;
+    float threshold;
+    char apply[MAX_COMMAND_SIZE];
+    char revert[MAX_COMMAND_SIZE];  /* empty if there is nothing to revert */
+    int applied;  /* the action has been applied during current outage */
+    int measuring;  /* load has to be measured on the next sample */
+    float load;  /* load at the moment of applying */
+}
+action_t;
+
+
+static action_t actions[MAX_ACTIONS];
+static unsigned int actions_count = 0;
+
+
+/*
+ * Copy the command trimming spaces around it.
+ * Return 0 on success and >0 if the command is too long.
+ */
+static int copy_command(char *dst, const char *src, size_t len)
+{
+    while (len && (*src == ' ' || *src == '\t')) {
+        src++;
+        len--;
+    }
+
+    while (len && (src[len - 1] == ' ' || src[len - 1] == '\t' || src[len - 1] == '\n'))
+        len--;
+
+    if (len >= MAX_COMMAND_SIZE)
+        return 1;
+
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+
+    return 0;
+}
+
+
+/*
+ * Parse the line into the action.
+ * Return 0 on success and >0 on error.
+ */
+static int parse_action(const char *line, action_t *action)
+{
+    char trigger[16];
+    int offset = 0;
+
+    if (sscanf(line, "%15s %f %n", trigger, &(action->threshold), &offset) != 2 || !offset)
+        return 1;
+
+    if (!strcmp(trigger, "time"))
+        action->trigger = TRIGGER_TIME;
+    else if (!strcmp(trigger, "battery"))
+        action->trigger = TRIGGER_BATTERY;
+    else if (!strcmp(trigger, "load"))
+        action->trigger = TRIGGER_LOAD;
+    else
+        return 1;
+
+    const char *apply = line + offset;
+    const char *revert = strchr(apply, '|');
+
+    if (copy_command(action->apply, apply, revert == NULL ? strlen(apply) : (size_t) (revert - apply)))
+        return 1;
+
+    if (revert != NULL && copy_command(action->revert, revert + 1, strlen(revert + 1)))
+        return 1;
+
+    return !*(action->apply);
+}
+
+
+int load_actions(const char *path)
+{
+    char line[2 * MAX_COMMAND_SIZE];
+    unsigned int line_no = 0;
+    int ret = 1;
+
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        LOG_E("unable to open actions file '%s', error '%m'", path);
+        return 1;
+    }
+
+    memset(actions, 0, sizeof(actions));
+    actions_count = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+
+        const char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || !*start)
+            continue;
+
+        if (actions_count == MAX_ACTIONS) {
+            LOG_E("too many actions in '%s', max %d", path, MAX_ACTIONS);
+            goto on_exit;
+        }
+
+        if (parse_action(start, &(actions[actions_count]))) {
+            LOG_E("invalid action in '%s' at line %u", path, line_no);
+            goto on_exit;
+        }
+
+        actions_count++;
+    }
+
+    LOG_I("%u actions loaded from '%s'", actions_count, path);
+    ret = 0;
+
+on_exit:
+
+    fclose(file);
+
+    return ret;
+}
+
+
+const char* get_action_command(const unsigned int index, const int revert)
+{
+    if (index >= actions_count)
+        return NULL;
+
+    const char *command = revert ? actions[index].revert : actions[index].apply;
+
+    return *command ? command : NULL;
+}
+
+
+/*
+ * Check whether the action trigger is met.
+ */
+static int is_triggered(const action_t *action, const ups_sample *sample, const uint64_t offline_ms)
+{
+    switch (action->trigger) {
+        case TRIGGER_TIME:
+            return offline_ms >= (uint64_t) (action->threshold * 1000);
+
+        case TRIGGER_BATTERY:
+            return !isnan(sample->battery_voltage) && sample->battery_voltage <= action->threshold;
+
+        case TRIGGER_LOAD:
+            return !isnan(sample->load) && sample->load >= action->threshold;
+    }
+
+    return 0;
+}
+
+
+void update_actions(const ups_sample *sample, const int offline, const uint64_t offline_ms)
+{
+    for (unsigned int i = 0; i < actions_count; i++) {
+        action_t *action = &(actions[i]);
+
+        if (!action->measuring)
+            continue;
+
+        LOG_I("stage %u: load changed from %.1f%% to %.1f%%", i + 1, action->load, sample->load);
+        action->measuring = 0;
+    }
+
+    if (!offline) {
+        for (unsigned int i = actions_count; i-- > 0;) {
+            action_t *action = &(actions[i]);
+
+            if (!action->applied)
+                continue;
+
+            LOG_I("UPS is online, reverting stage %u", i + 1);
+            action->applied = 0;
+            if (*(action->revert) && run_action(i, 1))
+                LOG_E("unable to revert stage %u", i + 1);
+        }
+        return;
+    }
+
+    for (unsigned int i = 0; i < actions_count; i++) {
+        action_t *action = &(actions[i]);
+
+        if (action->applied || !is_triggered(action, sample, offline_ms))
+            continue;
+
+        LOG_I("applying stage %u after %" PRIu64 " ms on battery, load %.1f%%", i + 1, offline_ms, sample->load);
+        action->applied = 1;
+        action->measuring = 1;
+        action->load = sample->load;
+        if (run_action(i, 0))
+            LOG_E("unable to apply stage %u", i + 1);
+    }
+}
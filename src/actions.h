@@ -0,0 +1,53 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ACTIONS_H_
+#define ACTIONS_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+
+/*
+ * Load staged actions from the file, each line is:
+ *      <TRIGGER> <THRESHOLD> <APPLY COMMAND> [| <REVERT COMMAND>]
+ * where trigger is one of:
+ *      time - seconds on battery are greater or equal to threshold;
+ *      battery - battery voltage is less or equal to threshold;
+ *      load - load (%) is greater or equal to threshold;
+ * Empty lines and lines started with '#' are ignored.
+ * Must be called before `init_privileges()', commands are run by the root helper.
+ * Return 0 on success and >0 on error.
+ */
+int load_actions(const char *path);
+
+/*
+ * Return the apply (or revert) command of the action or NULL if there is none.
+ */
+const char* get_action_command(const unsigned int index, const int revert);
+
+/*
+ * Apply actions whose triggers are met while UPS is offline and revert all
+ * applied actions when it becomes online. Log load change caused by each stage.
+ */
+void update_actions(const ups_sample *sample, const int offline, const uint64_t offline_ms);
+
+
+#endif /* ACTIONS_H_ */
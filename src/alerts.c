@@ -0,0 +1,949 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "alerts.h"
+#include "log.h"
+#include "policy.h"
+#include "realtime.h"
+#include "stats.h"
+
+
+#define MAX_SINKS (4)
+#define MAX_TARGET_SIZE (256)
+#define SINK_QUEUE_SIZE (32)  /* the oldest alerts are dropped if a sink is unavailable too long */
+#define INVALID_SAMPLES (3)  /* consecutive invalid samples to alert, a single bad frame is not worth it */
+#define IO_TIMEOUT (5)  /* timeout of each network operation, seconds */
+#define REPLY_SIZE (512)
+#define MESSAGE_END_SIZE (32)  /* room kept for the end of the message */
+
+/* the sink test builds this file with shorter delays and a smaller message */
+#ifndef BATCH_DELAY
+#define BATCH_DELAY (5000)  /* time to collect a burst of alerts into one message, milliseconds */
+#endif
+#ifndef RETRY_DELAY_MIN
+#define RETRY_DELAY_MIN (5000)  /* delay after the first failed delivery, milliseconds */
+#endif
+#ifndef RETRY_DELAY_MAX
+#define RETRY_DELAY_MAX (300000)
+#endif
+#ifndef MESSAGE_SIZE
+#define MESSAGE_SIZE (16384)
+#endif
+
+
+typedef enum {
+    SINK_WEBHOOK,
+    SINK_SMTP,
+    SINK_SPOOL
+}
+sink_type;
+
+
+typedef enum {
+    ALERT_ONLINE,  /* status alerts are in the same order as UPS statuses */
+    ALERT_OFFLINE,
+    ALERT_INVALID,
+    ALERT_BATTERY_LOW
+}
+alert_type;
+
+
+typedef struct {
+    alert_type type;
+    unsigned int feed;
+    uint64_t seq;  /* sequence number to find delivered alerts */
+    uint64_t time;  /* realtime, milliseconds */
+    ups_sample sample;  /* not valid for ALERT_INVALID */
+}
+alert_t;
+
+
+typedef struct {
+    sink_type type;
+    char host[MAX_TARGET_SIZE];
+    char service[16];
+    char path[MAX_TARGET_SIZE];  /* webhook path or spool directory */
+    char from[MAX_TARGET_SIZE];
+    char to[MAX_TARGET_SIZE];
+    struct sockaddr_storage addr;  /* resolved on loading */
+    socklen_t addr_len;
+
+    /* protected by the mutex */
+    alert_t queue[SINK_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int count;
+    unsigned int failures;  /* consecutive failed deliveries */
+    uint64_t due;  /* monotonic time of the next delivery, milliseconds */
+}
+sink_t;
+
+
+static sink_t sinks[MAX_SINKS];
+static unsigned int sinks_count = 0;
+
+static pthread_t thread;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static int started = 0;
+static int stopping = 0;  /* protected by the mutex */
+
+/* used by the delivery thread only */
+static alert_t batch[SINK_QUEUE_SIZE];
+static char message[MESSAGE_SIZE];
+
+/* used by the publishing thread only */
+static ups_status last_status[MAX_FEEDS];  /* zeros are UPS_ONLINE */
+static unsigned int invalid_samples[MAX_FEEDS];  /* consecutive invalid samples */
+static int battery_low[MAX_FEEDS];
+static uint64_t last_seq = 0;
+
+
+static const char *alert_names[] = {
+    "online",
+    "offline",
+    "invalid",
+    "battery_low"
+};
+
+static const char *alert_texts[] = {
+    "UPS is online",
+    "UPS is on battery",
+    "UPS does not respond",
+    "UPS battery is low"
+};
+
+
+static uint64_t get_time_ms(void)
+{
+    return get_time_ns() / 1000000;
+}
+
+
+/*
+ * Split "<HOST>[:<PORT>]" into the host and the service.
+ * Return 0 on success and >0 on error.
+ */
+static int parse_address(sink_t *sink, const char *address, const size_t len, const char *default_service)
+{
+    const char *colon = memchr(address, ':', len);
+    const size_t host_len = colon != NULL ? (size_t) (colon - address) : len;
+
+    if (!host_len || host_len >= sizeof(sink->host))
+        return 1;
+
+    memcpy(sink->host, address, host_len);
+    sink->host[host_len] = '\0';
+
+    if (colon == NULL) {
+        strcpy(sink->service, default_service);
+        return 0;
+    }
+
+    const size_t service_len = len - host_len - 1;
+
+    if (!service_len || service_len >= sizeof(sink->service))
+        return 1;
+
+    memcpy(sink->service, colon + 1, service_len);
+    sink->service[service_len] = '\0';
+
+    return 0;
+}
+
+
+/*
+ * Resolve the sink address once, so delivery does not depend on DNS during outages.
+ * Return 0 on success and >0 on error.
+ */
+static int resolve_sink(sink_t *sink)
+{
+    struct addrinfo *addrs = NULL;
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+
+    const int ret = getaddrinfo(sink->host, sink->service, &hints, &addrs);
+    if (ret) {
+        LOG_E("unable to resolve '%s:%s', error '%s'", sink->host, sink->service, gai_strerror(ret));
+        return 1;
+    }
+
+    memcpy(&(sink->addr), addrs->ai_addr, addrs->ai_addrlen);
+    sink->addr_len = addrs->ai_addrlen;
+
+    freeaddrinfo(addrs);
+
+    return 0;
+}
+
+
+/*
+ * Parse the line into the sink.
+ * Return 0 on success and >0 on error.
+ */
+static int parse_sink(const char *line, sink_t *sink)
+{
+    char type[16];
+    char target[MAX_TARGET_SIZE];
+
+    if (sscanf(line, "%15s %255s", type, target) != 2)
+        return 1;
+
+    if (!strcmp(type, "webhook")) {
+        sink->type = SINK_WEBHOOK;
+
+        if (strncmp(target, "http://", 7))
+            return 1;
+
+        const char *address = target + 7;
+        const char *path = strchr(address, '/');
+
+        if (parse_address(sink, address, path != NULL ? (size_t) (path - address) : strlen(address), "80"))
+            return 1;
+
+        strcpy(sink->path, path != NULL ? path : "/");
+
+        return resolve_sink(sink);
+    }
+
+    if (!strcmp(type, "smtp")) {
+        sink->type = SINK_SMTP;
+
+        if (sscanf(line, "%*s %*s %255s %255s", sink->from, sink->to) != 2)
+            return 1;
+
+        return parse_address(sink, target, strlen(target), "25") || resolve_sink(sink);
+    }
+
+    if (!strcmp(type, "spool")) {
+        sink->type = SINK_SPOOL;
+        strcpy(sink->path, target);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int load_alerts(const char *path)
+{
+    char line[4 * MAX_TARGET_SIZE];
+    unsigned int line_no = 0;
+    int ret = 1;
+
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        LOG_E("unable to open alerts file '%s', error '%m'", path);
+        return 1;
+    }
+
+    memset(sinks, 0, sizeof(sinks));
+    sinks_count = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+
+        const char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || !*start)
+            continue;
+
+        if (sinks_count == MAX_SINKS) {
+            LOG_E("too many alert sinks in '%s', max %d", path, MAX_SINKS);
+            goto on_exit;
+        }
+
+        if (parse_sink(start, &(sinks[sinks_count]))) {
+            LOG_E("invalid alert sink in '%s' at line %u", path, line_no);
+            goto on_exit;
+        }
+
+        sinks_count++;
+    }
+
+    LOG_I("%u alert sinks loaded from '%s'", sinks_count, path);
+    ret = 0;
+
+on_exit:
+
+    fclose(file);
+
+    return ret;
+}
+
+
+/*
+ * Append the formatted text to the buffer at `*len', nothing is appended if it does not fit.
+ * Return 0 on success and >0 if the buffer is full.
+ */
+static int append(char *buf, const size_t size, size_t *len, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    const int ret = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+
+    if (ret < 0 || (size_t) ret >= size - *len) {
+        buf[*len] = '\0';
+        return 1;
+    }
+
+    *len += ret;
+
+    return 0;
+}
+
+
+static int append_value(char *buf, const size_t size, size_t *len, const char *name, const float value)
+{
+    if (isnan(value))
+        return append(buf, size, len, ",\"%s\":null", name);
+
+    return append(buf, size, len, ",\"%s\":%.1f", name, value);
+}
+
+
+static int append_json(const size_t size, size_t *len, const unsigned int index)
+{
+    const alert_t *alert = &(batch[index]);
+
+    if (append(message, size, len, "%s{\"event\":\"%s\",\"time\":%" PRIu64 ",\"feed\":%u",
+               index ? "," : "", alert_names[alert->type], alert->time, alert->feed))
+        return 1;
+
+    if (alert->type != ALERT_INVALID &&
+        (append_value(message, size, len, "input_voltage", alert->sample.input_voltage) ||
+         append_value(message, size, len, "battery_voltage", alert->sample.battery_voltage) ||
+         append_value(message, size, len, "load", alert->sample.load) ||
+         append(message, size, len, ",\"flags\":\"%02X\"", alert->sample.flags)))
+        return 1;
+
+    return append(message, size, len, "}");
+}
+
+
+/*
+ * Format alerts as JSON document. Alerts which do not fit are dropped whole,
+ * their amount is given as "dropped", so the document is always complete.
+ * Return its length.
+ */
+static size_t format_json(const unsigned int count)
+{
+    size_t len = 0;
+    unsigned int dropped = 0;
+
+    append(message, sizeof(message), &len, "{\"alerts\":[");
+
+    for (unsigned int i = 0; i < count; i++) {
+        const size_t start = len;
+
+        if (append_json(sizeof(message) - MESSAGE_END_SIZE, &len, i)) {
+            message[start] = '\0';
+            len = start;
+            dropped = count - i;
+            break;
+        }
+    }
+
+    if (dropped) {
+        LOG_E("%u alerts do not fit into the message and are dropped", dropped);
+        append(message, sizeof(message), &len, "],\"dropped\":%u}\n", dropped);
+    }
+    else
+        append(message, sizeof(message), &len, "]}\n");
+
+    return len;
+}
+
+
+static int append_text(char *buf, const size_t size, size_t *len, const unsigned int index)
+{
+    struct tm tm;
+    char date[32];
+    const alert_t *alert = &(batch[index]);
+    const time_t time = alert->time / 1000;
+
+    if (!strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&time, &tm)))
+        date[0] = '\0';
+
+    if (append(buf, size, len, "%s ", date))
+        return 1;
+
+    if (get_feeds_count() > 1 && append(buf, size, len, "feed %u: ", alert->feed))
+        return 1;
+
+    if (append(buf, size, len, "%s", alert_texts[alert->type]))
+        return 1;
+
+    if (alert->type != ALERT_INVALID &&
+        append(buf, size, len, ", input %.1f V, battery %.1f V, load %.0f%%",
+               alert->sample.input_voltage, alert->sample.battery_voltage, alert->sample.load))
+        return 1;
+
+    return append(buf, size, len, "\r\n");
+}
+
+
+/*
+ * Format alerts as mail body, one line per alert, alerts which do not fit are dropped whole.
+ * Return its length.
+ */
+static size_t format_text(char *buf, const size_t size, const unsigned int count)
+{
+    size_t len = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        const size_t start = len;
+
+        if (append_text(buf, size - MESSAGE_END_SIZE, &len, i)) {
+            buf[start] = '\0';
+            len = start;
+            LOG_E("%u alerts do not fit into the message and are dropped", count - i);
+            append(buf, size, &len, "%u more alerts are dropped\r\n", count - i);
+            break;
+        }
+    }
+
+    return len;
+}
+
+
+/*
+ * Connect to the sink with timeouts applied to all operations.
+ * Return the socket or -1 on error.
+ */
+static int connect_sink(const sink_t *sink)
+{
+    const struct timeval timeout = {
+        .tv_sec = IO_TIMEOUT
+    };
+
+    const int fd = socket(sink->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_E("unable to create socket, error '%m'");
+        return -1;
+    }
+
+    /* the send timeout is applied to connect() too */
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+        LOG_E("unable to set socket timeouts, error '%m'");
+        close(fd);
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr*) &(sink->addr), sink->addr_len)) {
+        LOG_E("unable to connect to '%s:%s', error '%m'", sink->host, sink->service);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/*
+ * Send the whole buffer.
+ * Return 0 on success and >0 on error.
+ */
+static int send_all(const int fd, const char *buf, size_t size)
+{
+    while (size) {
+        const ssize_t sent = send(fd, buf, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            LOG_E("unable to send alert, error '%m'");
+            return 1;
+        }
+
+        buf += sent;
+        size -= sent;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read the reply up to the end of its last line.
+ * Return 0 on success and >0 on error.
+ */
+static int read_reply(const int fd, char *reply, const size_t size, const int smtp)
+{
+    size_t len = 0;
+
+    for (;;) {
+        const ssize_t count = recv(fd, reply + len, size - 1 - len, 0);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            LOG_E("no reply in %d seconds", IO_TIMEOUT);
+            return 1;
+        }
+
+        if (count <= 0) {
+            LOG_E("unable to read reply, error '%m'");
+            return 1;
+        }
+
+        len += count;
+        reply[len] = '\0';
+
+        if (!smtp || len == size - 1)
+            return 0;
+
+        /* the last line of SMTP reply has space after the code */
+        const char *last = reply;
+        const char *end;
+
+        while ((end = strstr(last, "\r\n")) != NULL && end[2])
+            last = end + 2;
+
+        if (end != NULL && strlen(last) > 3 && last[3] == ' ')
+            return 0;
+    }
+}
+
+
+static int deliver_webhook(const sink_t *sink, const unsigned int count)
+{
+    char header[2 * MAX_TARGET_SIZE];
+    char reply[REPLY_SIZE];
+    int ret = 1;
+
+    const size_t body_len = format_json(count);
+    const int header_len = snprintf(header, sizeof(header),
+                                    "POST %s HTTP/1.1\r\n"
+                                    "Host: %s\r\n"
+                                    "Content-Type: application/json\r\n"
+                                    "Content-Length: %zu\r\n"
+                                    "Connection: close\r\n"
+                                    "\r\n",
+                                    sink->path, sink->host, body_len);
+
+    const int fd = connect_sink(sink);
+    if (fd < 0)
+        return 1;
+
+    if (send_all(fd, header, header_len) || send_all(fd, message, body_len) || read_reply(fd, reply, sizeof(reply), 0))
+        goto on_error;
+
+    if (strlen(reply) < 10 || strncmp(reply, "HTTP/1.", 7) || reply[8] != ' ' || reply[9] != '2') {
+        reply[strcspn(reply, "\r\n")] = '\0';
+        LOG_E("webhook '%s:%s%s' has answered '%s'", sink->host, sink->service, sink->path, reply);
+        goto on_error;
+    }
+
+    ret = 0;
+
+on_error:
+
+    close(fd);
+
+    return ret;
+}
+
+
+/*
+ * Send SMTP command (if any) and check the reply code class.
+ * Return 0 on success and >0 on error.
+ */
+static int smtp_command(const int fd, const char *command, const char expected)
+{
+    char reply[REPLY_SIZE];
+
+    if (command != NULL && send_all(fd, command, strlen(command)))
+        return 1;
+
+    if (read_reply(fd, reply, sizeof(reply), 1))
+        return 1;
+
+    if (reply[0] != expected) {
+        reply[strcspn(reply, "\r\n")] = '\0';
+        LOG_E("SMTP server has answered '%s'", reply);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int deliver_smtp(const sink_t *sink, const unsigned int count)
+{
+    char command[2 * MAX_TARGET_SIZE];
+    char host[HOST_NAME_MAX + 1] = "localhost";
+    int ret = 1;
+
+    gethostname(host, sizeof(host));
+
+    const int fd = connect_sink(sink);
+    if (fd < 0)
+        return 1;
+
+    if (smtp_command(fd, NULL, '2'))
+        goto on_error;
+
+    snprintf(command, sizeof(command), "HELO %s\r\n", host);
+    if (smtp_command(fd, command, '2'))
+        goto on_error;
+
+    snprintf(command, sizeof(command), "MAIL FROM:<%s>\r\n", sink->from);
+    if (smtp_command(fd, command, '2'))
+        goto on_error;
+
+    snprintf(command, sizeof(command), "RCPT TO:<%s>\r\n", sink->to);
+    if (smtp_command(fd, command, '2'))
+        goto on_error;
+
+    if (smtp_command(fd, "DATA\r\n", '3'))
+        goto on_error;
+
+    /* lines never start with a dot, no escaping is needed */
+    size_t len = 0;
+
+    if (append(message, sizeof(message) - MESSAGE_END_SIZE, &len,
+               "From: %s\r\n"
+               "To: %s\r\n"
+               "Subject: %s: %s\r\n"
+               "\r\n",
+               sink->from, sink->to, host, alert_texts[batch[count - 1].type])) {
+        LOG_E("mail header does not fit into the message");
+        goto on_error;
+    }
+
+    len += format_text(message + len, sizeof(message) - len - 8, count);
+    append(message, sizeof(message), &len, ".\r\n");
+
+    if (send_all(fd, message, len) || smtp_command(fd, NULL, '2'))
+        goto on_error;
+
+    smtp_command(fd, "QUIT\r\n", '2');
+
+    ret = 0;
+
+on_error:
+
+    close(fd);
+
+    return ret;
+}
+
+
+static int deliver_spool(const sink_t *sink, const unsigned int count)
+{
+    char name[PATH_MAX];
+    char temp[PATH_MAX];
+
+    const size_t len = format_json(count);
+
+    /* the file appears complete to spool readers */
+    if (snprintf(name, sizeof(name), "%s/%" PRIu64 "-%" PRIu64 ".json", sink->path, batch[0].time, batch[0].seq) >= (int) sizeof(name) ||
+        snprintf(temp, sizeof(temp), "%s.tmp", name) >= (int) sizeof(temp)) {
+        LOG_E("spool directory name '%s' is too long", sink->path);
+        return 1;
+    }
+
+    const int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_E("unable to create spool file '%s', error '%m'", temp);
+        return 1;
+    }
+
+    if (write(fd, message, len) != (ssize_t) len || fsync(fd)) {
+        LOG_E("unable to write spool file '%s', error '%m'", temp);
+        close(fd);
+        goto on_error;
+    }
+
+    if (close(fd)) {
+        LOG_E("unable to close spool file '%s', error '%m'", temp);
+        goto on_error;
+    }
+
+    if (rename(temp, name)) {
+        LOG_E("unable to rename spool file '%s', error '%m'", temp);
+        goto on_error;
+    }
+
+    return 0;
+
+on_error:
+
+    unlink(temp);
+
+    return 1;
+}
+
+
+/*
+ * Deliver alerts from the batch to the sink.
+ * Return 0 on success and >0 on error.
+ */
+static int deliver(const sink_t *sink, const unsigned int count)
+{
+    switch (sink->type) {
+        case SINK_WEBHOOK:
+            return deliver_webhook(sink, count);
+
+        case SINK_SMTP:
+            return deliver_smtp(sink, count);
+
+        case SINK_SPOOL:
+            return deliver_spool(sink, count);
+    }
+
+    return 1;
+}
+
+
+static const char *sink_names[] = {
+    "webhook",
+    "smtp",
+    "spool"
+};
+
+
+/*
+ * Deliver queued alerts of the sink, the mutex is released during delivery.
+ */
+static void flush_sink(sink_t *sink, const uint64_t now)
+{
+    const unsigned int count = sink->count;
+
+    for (unsigned int i = 0; i < count; i++)
+        batch[i] = sink->queue[(sink->head + i) % SINK_QUEUE_SIZE];
+
+    const uint64_t delivered_seq = batch[count - 1].seq;
+
+    pthread_mutex_unlock(&mutex);
+
+    const int ret = deliver(sink, count);
+
+    pthread_mutex_lock(&mutex);
+
+    if (ret) {
+        /* exponential backoff */
+        const unsigned int shift = sink->failures < 16 ? sink->failures : 16;
+        const uint64_t delay = (uint64_t) RETRY_DELAY_MIN << shift;
+
+        sink->failures++;
+        sink->due = now + (delay < RETRY_DELAY_MAX ? delay : RETRY_DELAY_MAX);
+
+        LOG_E("unable to deliver %u alerts to %s sink, attempt %u", count, sink_names[sink->type], sink->failures);
+        return;
+    }
+
+    /* alerts queued during delivery stay in the queue, dropped ones are gone already */
+    while (sink->count && sink->queue[sink->head].seq <= delivered_seq) {
+        sink->head = (sink->head + 1) % SINK_QUEUE_SIZE;
+        sink->count--;
+    }
+
+    sink->failures = 0;
+    sink->due = now + BATCH_DELAY;
+
+    LOG_I("%u alerts delivered to %s sink", count, sink_names[sink->type]);
+}
+
+
+static void* run_delivery(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&mutex);
+
+    while (!stopping) {
+        const uint64_t now = get_time_ms();
+        uint64_t next = 0;
+        sink_t *due_sink = NULL;
+
+        for (unsigned int i = 0; i < sinks_count; i++) {
+            sink_t *sink = &(sinks[i]);
+
+            if (!sink->count)
+                continue;
+
+            if (sink->due <= now) {
+                due_sink = sink;
+                break;
+            }
+
+            if (!next || sink->due < next)
+                next = sink->due;
+        }
+
+        if (due_sink != NULL) {
+            flush_sink(due_sink, now);
+            continue;
+        }
+
+        if (!next) {
+            pthread_cond_wait(&cond, &mutex);
+            continue;
+        }
+
+        const struct timespec deadline = {
+            .tv_sec = next / 1000,
+            .tv_nsec = (next % 1000) * 1000000
+        };
+
+        pthread_cond_timedwait(&cond, &mutex, &deadline);
+    }
+
+    for (unsigned int i = 0; i < sinks_count; i++)
+        if (sinks[i].count)
+            flush_sink(&(sinks[i]), get_time_ms());
+
+    pthread_mutex_unlock(&mutex);
+
+    return NULL;
+}
+
+
+int start_alerts(void)
+{
+    pthread_condattr_t attr;
+
+    if (!sinks_count)
+        return 0;
+
+    tzset();  /* mail dates are local, load the time zone before the heap usage is marked */
+
+    /* delivery times are monotonic */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (start_background_thread(&thread, "alert", run_delivery)) {
+        pthread_cond_destroy(&cond);
+        return 1;
+    }
+
+    started = 1;
+
+    return 0;
+}
+
+
+/*
+ * Queue the alert to all sinks, the oldest alert is dropped if a queue is full.
+ */
+static void queue_alert(const alert_type type, const unsigned int feed, const ups_sample *sample)
+{
+    struct timespec tm;
+    alert_t alert = {
+        .type = type,
+        .feed = feed,
+        .seq = ++last_seq
+    };
+
+    if (sample != NULL)
+        alert.sample = *sample;
+
+    if (!clock_gettime(CLOCK_REALTIME, &tm))
+        alert.time = (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+
+    LOG_D("alert '%s' of feed %u queued", alert_names[type], feed);
+
+    pthread_mutex_lock(&mutex);
+
+    for (unsigned int i = 0; i < sinks_count; i++) {
+        sink_t *sink = &(sinks[i]);
+
+        if (sink->count == SINK_QUEUE_SIZE) {
+            LOG_E("alert queue of %s sink is full, the oldest alert is dropped", sink_names[sink->type]);
+            sink->head = (sink->head + 1) % SINK_QUEUE_SIZE;
+            sink->count--;
+        }
+
+        /* the first alert of a burst waits for the rest */
+        if (!sink->count)
+            sink->due = get_time_ms() + BATCH_DELAY;
+
+        sink->queue[(sink->head + sink->count) % SINK_QUEUE_SIZE] = alert;
+        sink->count++;
+    }
+
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void publish_alert(const unsigned int feed, const ups_status status, const ups_sample *sample)
+{
+    if (!started)
+        return;
+
+    if (status == INVALID_RESPONSE) {
+        if (invalid_samples[feed] < INVALID_SAMPLES)
+            invalid_samples[feed]++;
+        if (invalid_samples[feed] < INVALID_SAMPLES)
+            return;  /* the feed keeps its last status until invalid samples persist */
+    }
+    else
+        invalid_samples[feed] = 0;
+
+    if (status != last_status[feed])
+        queue_alert((alert_type) status, feed, sample);
+
+    const int low = sample != NULL && (sample->flags & UPS_FLAG_BATTERY_LOW);
+
+    if (low && !battery_low[feed])
+        queue_alert(ALERT_BATTERY_LOW, feed, sample);
+
+    last_status[feed] = status;
+
+    if (sample != NULL)
+        battery_low[feed] = low;
+}
+
+
+void stop_alerts(void)
+{
+    if (!started)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    const int ret = pthread_join(thread, NULL);
+    if (ret)
+        LOG_E("unable to join alert thread, error '%s'", strerror(ret));
+
+    pthread_cond_destroy(&cond);
+
+    started = 0;
+}
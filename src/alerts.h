@@ -0,0 +1,56 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ALERTS_H_
+#define ALERTS_H_
+
+#include "protocol.h"
+
+
+/*
+ * Load alert sinks from the file, each line is one of:
+ *      webhook http://<HOST>[:<PORT>]/<PATH>
+ *      smtp <HOST>[:<PORT>] <FROM> <TO>
+ *      spool <DIR>
+ * Empty lines and lines started with '#' are ignored.
+ * Return 0 on success and >0 on error.
+ */
+int load_alerts(const char *path);
+
+/*
+ * Start the delivery thread if there are sinks.
+ * Return 0 on success and >0 on error.
+ */
+int start_alerts(void);
+
+/*
+ * Queue alerts to all sinks if UPS status of the feed has changed or its battery has become low,
+ * invalid status is taken only after a few invalid samples in a row.
+ * Alerts are delivered asynchronously: bursts are sent as one message, failed
+ * deliveries are retried with exponential backoff.
+ */
+void publish_alert(const unsigned int feed, const ups_status status, const ups_sample *sample);
+
+/*
+ * Try to deliver pending alerts once and stop the delivery thread.
+ */
+void stop_alerts(void);
+
+
+#endif /* ALERTS_H_ */
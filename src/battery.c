@@ -0,0 +1,362 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "battery.h"
+#include "log.h"
+#include "policy.h"
+#include "probes.h"
+
+
+#define BATTERY_MAGIC (0x42505346)  /* 'FSPB' */
+#define BATTERY_VERSION (1)
+
+#define REST_AGE_MS (60000)  /* max age of the sample before the discharge to be its first point */
+#define MIN_LOAD (5.0)  /* min average load to normalize the rate by, % */
+#define CAPACITY_WEIGHT (0.25f)  /* weight of the new estimate in the EWMA */
+#define REPLACE_CAPACITY (0.8f)  /* batteries are worn out below this capacity */
+#define TEST_WINDOW (3600)  /* the test may run within the hour after the scheduled time, seconds */
+
+
+typedef struct {
+    float baseline[DISCHARGE_KINDS];  /* discharge rates of the healthy battery, 0 if unknown */
+    float capacity;  /* estimated capacity relative to the baseline, 0 if unknown */
+    uint32_t discharges;  /* amount of fitted discharges */
+}
+unit_health;
+
+
+typedef struct {
+    uint32_t magic;  /* BATTERY_MAGIC */
+    uint32_t version;  /* BATTERY_VERSION */
+    int64_t last_test;  /* wall clock time of the last self-test, seconds since Epoch */
+    uint32_t next_feed;  /* feed to be tested next */
+    uint32_t reserved;
+    unit_health units[MAX_FEEDS];
+}
+persistent_health;
+
+
+/*
+ * Sums of the incremental linear regression of battery voltage against time,
+ * memory usage does not depend on the discharge length.
+ */
+typedef struct {
+    int active;
+    discharge_kind kind;
+    uint64_t start;  /* time of the first sample, ms */
+    unsigned int count;
+    double sum_t, sum_v, sum_tt, sum_tv, sum_load;
+    double min_t, max_t;  /* seconds since start */
+}
+discharge_fit;
+
+
+typedef struct {
+    discharge_fit fit;
+    uint64_t rest_time;  /* the last sample without discharge, 0 if none */
+    float rest_voltage, rest_load;
+}
+feed_battery;
+
+
+static const char *kind_names[] = {
+    "outage",
+    "test"
+};
+
+static const unsigned int min_samples[DISCHARGE_KINDS] = {6, 2};
+static const double min_duration[DISCHARGE_KINDS] = {60.0, 1.0};  /* seconds */
+
+static persistent_health *health = NULL;
+static feed_battery feeds[MAX_FEEDS];  /* used by the export thread only */
+
+/* used by the event loop thread only */
+static int test_hour = -1;
+static time_t next_test = 0;
+
+
+/*
+ * Find the next local time of the test after the last one.
+ */
+static time_t schedule_test(const time_t now)
+{
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    tm.tm_hour = test_hour;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    time_t time = mktime(&tm);
+
+    if (now >= time + TEST_WINDOW || health->last_test >= time) {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        time = mktime(&tm);
+    }
+
+    return time;
+}
+
+
+int open_battery(const char *path, const int hour)
+{
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_E("unable to open battery file '%s', error '%m'", path);
+        return 1;
+    }
+
+    if (ftruncate(fd, sizeof(persistent_health))) {
+        LOG_E("unable to resize battery file '%s', error '%m'", path);
+        close(fd);
+        return 1;
+    }
+
+    health = mmap(NULL, sizeof(persistent_health), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (health == MAP_FAILED) {
+        LOG_E("unable to map battery file '%s', error '%m'", path);
+        health = NULL;
+        return 1;
+    }
+
+    if (health->magic != BATTERY_MAGIC || health->version != BATTERY_VERSION) {
+        memset(health, 0, sizeof(*health));
+        health->magic = BATTERY_MAGIC;
+        health->version = BATTERY_VERSION;
+        LOG_D("battery file '%s' initialized", path);
+    }
+
+    memset(feeds, 0, sizeof(feeds));
+
+    test_hour = hour;
+    if (test_hour >= 0) {
+        tzset();  /* load the time zone before the heap usage is marked */
+        next_test = schedule_test(time(NULL));
+        LOG_D("next battery self-test at %" PRId64, (int64_t) next_test);
+    }
+
+    return 0;
+}
+
+
+static void add_point(discharge_fit *fit, const double t, const float voltage, const float load)
+{
+    fit->count++;
+    fit->sum_t += t;
+    fit->sum_v += voltage;
+    fit->sum_tt += t * t;
+    fit->sum_tv += t * voltage;
+    fit->sum_load += load;
+
+    if (t < fit->min_t)
+        fit->min_t = t;
+    if (t > fit->max_t)
+        fit->max_t = t;
+}
+
+
+static void start_fit(feed_battery *feed, const discharge_kind kind, const uint64_t time)
+{
+    discharge_fit *fit = &(feed->fit);
+
+    memset(fit, 0, sizeof(*fit));
+    fit->active = 1;
+    fit->kind = kind;
+    fit->start = time;
+
+    if (feed->rest_time && time - feed->rest_time <= REST_AGE_MS)
+        add_point(fit, -((double) (time - feed->rest_time) / 1000.0), feed->rest_voltage, feed->rest_load);
+}
+
+
+/*
+ * Fit the discharge of the feed and update its capacity estimate.
+ * Return 1 if the result is set, 0 if the discharge is too short or has not discharged the battery.
+ */
+static int finish_fit(const unsigned int feed_index, battery_result *result)
+{
+    discharge_fit *fit = &(feeds[feed_index].fit);
+    unit_health *unit = &(health->units[feed_index]);
+    const discharge_kind kind = fit->kind;
+
+    fit->active = 0;
+
+    if (fit->count < min_samples[kind] || fit->max_t - fit->min_t < min_duration[kind]) {
+        LOG_D("UPS #%u %s is too short to be fitted, %u samples", feed_index, kind_names[kind], fit->count);
+        return 0;
+    }
+
+    const double n = fit->count;
+    const double slope = (n * fit->sum_tv - fit->sum_t * fit->sum_v) / (n * fit->sum_tt - fit->sum_t * fit->sum_t);
+    const double load = fit->sum_load / n;
+
+    if (load < MIN_LOAD || !(slope < 0.0)) {
+        LOG_D("UPS #%u %s is not fitted, slope %.6f V/s, load %.1f%%", feed_index, kind_names[kind], slope, load);
+        return 0;
+    }
+
+    const float rate = -slope * 60000.0 / load;
+
+    result->feed = feed_index;
+    result->kind = kind;
+    result->samples = fit->count;
+    result->rate = rate;
+
+    unit->discharges++;
+
+    if (unit->baseline[kind] == 0.0f) {
+        unit->baseline[kind] = rate;
+        LOG_I("UPS #%u %s baseline is %.2f mV/min per 1%% load, %u samples", feed_index, kind_names[kind],
+              rate, fit->count);
+    }
+    else {
+        const float estimate = unit->baseline[kind] / rate;
+
+        unit->capacity = unit->capacity == 0.0f ? estimate
+                         : unit->capacity + CAPACITY_WEIGHT * (estimate - unit->capacity);
+
+        LOG_I("UPS #%u %s rate is %.2f mV/min per 1%% load, %u samples, baseline %.2f, capacity %.0f%%",
+              feed_index, kind_names[kind], rate, fit->count, unit->baseline[kind], unit->capacity * 100.0f);
+
+        if (unit->capacity < REPLACE_CAPACITY)
+            LOG_E("UPS #%u battery capacity is %.0f%% of the baseline, replace the battery",
+                  feed_index, unit->capacity * 100.0f);
+    }
+
+    result->baseline = unit->baseline[kind];
+    result->capacity = unit->capacity == 0.0f ? NAN : unit->capacity;
+
+    PROBE4(battery, feed_index, kind, (unsigned int) (rate * 1000.0f), (unsigned int) (unit->capacity * 1000.0f));
+
+    return 1;
+}
+
+
+int update_battery(const unsigned int feed_index, const ups_status status, const ups_sample *sample,
+                   const uint64_t time, battery_result *result)
+{
+    feed_battery *feed = &(feeds[feed_index]);
+    discharge_fit *fit = &(feed->fit);
+    int ret = 0;
+
+    if (health == NULL || status == INVALID_RESPONSE)
+        return 0;
+
+    if (isnan(sample->battery_voltage) || isnan(sample->load))
+        return 0;
+
+    const int discharging = status == UPS_OFFLINE || (sample->flags & UPS_FLAG_TEST);
+    const discharge_kind kind = status == UPS_OFFLINE ? DISCHARGE_OUTAGE : DISCHARGE_TEST;
+
+    if (fit->active && (!discharging || kind != fit->kind))
+        ret = finish_fit(feed_index, result);
+
+    if (!discharging) {
+        feed->rest_time = time;
+        feed->rest_voltage = sample->battery_voltage;
+        feed->rest_load = sample->load;
+        return ret;
+    }
+
+    if (!fit->active)
+        start_fit(feed, kind, time);
+
+    add_point(fit, (double) (time - fit->start) / 1000.0, sample->battery_voltage, sample->load);
+
+    return ret;
+}
+
+
+int get_battery_test(const int quiet)
+{
+    if (health == NULL || test_hour < 0)
+        return -1;
+
+    const time_t now = time(NULL);
+
+    if (now < next_test)
+        return -1;
+
+    if (now >= next_test + TEST_WINDOW) {
+        next_test = schedule_test(now);
+        LOG_I("battery self-test skipped, UPS was not online");
+        return -1;
+    }
+
+    if (!quiet)
+        return -1;
+
+    const int feed = health->next_feed % get_feeds_count();
+
+    health->last_test = now;
+    health->next_feed = feed + 1;
+    next_test = schedule_test(now);
+
+    return feed;
+}
+
+
+void dump_battery(void)
+{
+    if (health == NULL)
+        return;
+
+    for (unsigned int i = 0; i < get_feeds_count(); i++) {
+        const unit_health *unit = &(health->units[i]);
+
+        if (unit->capacity == 0.0f)
+            LOG_I("battery: UPS #%u capacity is unknown, %" PRIu32 " discharges, baselines %.2f/%.2f",
+                  i, unit->discharges, unit->baseline[DISCHARGE_OUTAGE], unit->baseline[DISCHARGE_TEST]);
+        else
+            LOG_I("battery: UPS #%u capacity is %.0f%%, %" PRIu32 " discharges, baselines %.2f/%.2f",
+                  i, unit->capacity * 100.0f, unit->discharges,
+                  unit->baseline[DISCHARGE_OUTAGE], unit->baseline[DISCHARGE_TEST]);
+    }
+}
+
+
+void close_battery(void)
+{
+    battery_result result;
+
+    if (health == NULL)
+        return;
+
+    for (unsigned int i = 0; i < MAX_FEEDS; i++)
+        if (feeds[i].fit.active)
+            finish_fit(i, &result);
+
+    if (munmap(health, sizeof(*health)))
+        LOG_E("unable to unmap battery file, error '%m'");
+
+    health = NULL;
+}
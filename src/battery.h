@@ -0,0 +1,92 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BATTERY_H_
+#define BATTERY_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+
+/*
+ * Battery health is estimated from discharges: outages and self-tests
+ * (status bit "test in progress"). Battery voltage of every discharge is fitted
+ * against time with the incremental linear regression, the slope divided by the average
+ * load is the discharge rate. The first rate of each kind is stored as the baseline
+ * of the healthy battery, later ones give the capacity estimate: baseline rate / rate.
+ */
+
+typedef enum {
+    DISCHARGE_OUTAGE,
+    DISCHARGE_TEST
+}
+discharge_kind;
+
+#define DISCHARGE_KINDS (2)
+
+
+/*
+ * Result of the discharge fitting.
+ */
+typedef struct {
+    unsigned int feed;
+    discharge_kind kind;
+    unsigned int samples;  /* amount of fitted samples */
+    float rate;  /* discharge rate, mV per minute per 1% of load */
+    float baseline;  /* baseline rate of the kind */
+    float capacity;  /* estimated capacity relative to the baseline, NAN until known */
+}
+battery_result;
+
+
+/*
+ * Map the file with baselines and capacity estimates of all feeds.
+ * Run the self-test of one feed per day at the given local hour, no tests if it's negative.
+ * Return 0 on success and >0 on error.
+ */
+int open_battery(const char *path, const int test_hour);
+
+/*
+ * Add the sample (NULL if the response is invalid) taken at the given time since boot, ms,
+ * to the discharge of the feed, fit the discharge when it's over.
+ * Return 1 if the discharge has been fitted and the result is set, 0 otherwise.
+ */
+int update_battery(const unsigned int feed, const ups_status status, const ups_sample *sample,
+                   const uint64_t time, battery_result *result);
+
+/*
+ * Check if the self-test is due, `quiet' means all feeds are online.
+ * Return the feed to be tested or -1.
+ */
+int get_battery_test(const int quiet);
+
+/*
+ * Write baselines and capacity estimates of all feeds to the log.
+ */
+void dump_battery(void);
+
+/*
+ * Fit unfinished discharges (e.g. before the system shutdown) and unmap the file.
+ */
+void close_battery(void);
+
+
+#endif /* BATTERY_H_ */
@@ -0,0 +1,272 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "log.h"
+#include "protocol.h"
+#include "stats.h"
+#include "status.h"
+
+
+static int capture_fd = -1;
+
+
+int open_capture(const char *path)
+{
+    struct stat st;
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (capture_fd < 0) {
+        LOG_E("unable to open capture file '%s', error '%m'", path);
+        return 1;
+    }
+
+    if (fstat(capture_fd, &st)) {
+        LOG_E("unable to stat capture file '%s', error '%m'", path);
+        goto on_error;
+    }
+
+    if (!st.st_size && write(capture_fd, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != CAPTURE_MAGIC_SIZE) {
+        LOG_E("unable to write capture file '%s', error '%m'", path);
+        goto on_error;
+    }
+
+    LOG_I("capturing port data to '%s'", path);
+
+    return 0;
+
+on_error:
+
+    close_capture();
+
+    return 1;
+}
+
+
+void capture_data(const capture_direction direction, const void *data, const size_t size)
+{
+    struct timespec tm;
+    uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+
+    if (capture_fd < 0 || !size)
+        return;
+
+    clock_gettime(CLOCK_BOOTTIME, &tm);
+
+    const uint64_t time = (uint64_t) tm.tv_sec * 1000000000 + tm.tv_nsec;
+    const uint16_t data_size = size;
+
+    memcpy(header, &time, sizeof(time));
+    header[8] = direction;
+    header[9] = 0;
+    memcpy(header + 10, &data_size, sizeof(data_size));
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void*) data, .iov_len = size}
+    };
+
+    stats.syscalls++;
+
+    if (writev(capture_fd, iov, 2) != (ssize_t) (sizeof(header) + size))
+        LOG_E("unable to write capture, error '%m'");
+}
+
+
+void close_capture(void)
+{
+    if (capture_fd < 0)
+        return;
+
+    if (close(capture_fd))
+        LOG_E("unable to close capture file, error '%m'");
+
+    capture_fd = -1;
+}
+
+
+static uint64_t replay_time = 0;  /* virtual clock, milliseconds */
+static uint64_t replay_shutdowns = 0;
+
+
+static uint64_t get_replay_time(void)
+{
+    return replay_time;
+}
+
+
+static void replay_actions(const ups_sample *sample, const int offline, const uint64_t offline_ms)
+{
+    (void) sample;
+    (void) offline;
+    (void) offline_ms;
+}
+
+
+static int replay_shutdown(void)
+{
+    replay_shutdowns++;
+    LOG_I("replay: shutdown would be run at %" PRIu64 " ms", replay_time);
+    return 0;
+}
+
+
+static const status_ops replay_status_ops = {
+    .get_time = get_replay_time,
+    .update_actions = replay_actions,
+    .shutdown = replay_shutdown
+};
+
+
+/*
+ * Sleep until the record time given as the offset from the first record, ns.
+ */
+static void wait_record(const uint64_t offset, const struct timespec *start)
+{
+    int ret;
+
+    struct timespec deadline = {
+        .tv_sec = start->tv_sec + offset / 1000000000,
+        .tv_nsec = start->tv_nsec + offset % 1000000000
+    };
+
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR);
+
+    if (ret)
+        LOG_E("unable to sleep until the record time, error '%s'", strerror(ret));
+}
+
+
+int replay_capture(const char *path, const int fast, const unsigned int delay)
+{
+    struct stat st;
+    struct timespec start;
+    status_machine machine;
+    uint64_t frames = 0;
+    uint64_t invalid = 0;
+    uint64_t first = 0;  /* time of the first record */
+    uint64_t last = 0;  /* time of the previous record */
+    uint64_t shift = 0;  /* added to times of the segment to keep the replay time monotonic */
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_E("unable to open capture file '%s', error '%m'", path);
+        return 1;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) CAPTURE_MAGIC_SIZE) {
+        LOG_E("invalid capture file '%s'", path);
+        close(fd);
+        return 1;
+    }
+
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        LOG_E("unable to map capture file '%s', error '%m'", path);
+        return 1;
+    }
+
+    if (memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) {
+        LOG_E("invalid capture file '%s'", path);
+        munmap((void*) data, st.st_size);
+        return 1;
+    }
+
+    init_status(&machine, &replay_status_ops, delay);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const uint64_t started = get_time_ns();
+    size_t offset = CAPTURE_MAGIC_SIZE;
+
+    while (offset + CAPTURE_RECORD_HEADER_SIZE <= (size_t) st.st_size) {
+        uint64_t time;
+        uint16_t size;
+        char response[RESPONSE_SIZE];
+        ups_sample sample;
+
+        memcpy(&time, data + offset, sizeof(time));
+        memcpy(&size, data + offset + 10, sizeof(size));
+
+        const uint8_t direction = data[offset + 8];
+        const uint8_t *payload = data + offset + CAPTURE_RECORD_HEADER_SIZE;
+
+        offset += CAPTURE_RECORD_HEADER_SIZE + size;
+        if (offset > (size_t) st.st_size) {
+            LOG_E("truncated record at the end of capture file '%s'", path);
+            break;
+        }
+
+        if (direction != CAPTURE_READ)
+            continue;
+
+        if (!frames)
+            first = time;
+        else if (time < last) {
+            /* the daemon has been restarted after reboot, the segment continues the replay */
+            LOG_I("capture time goes back by %" PRIu64 " ns, new segment", last - time);
+            shift += last - time;
+            init_status(&machine, &replay_status_ops, delay);
+        }
+
+        last = time;
+        time += shift;
+
+        if (!fast)
+            wait_record(time - first, &start);
+
+        memset(response, 0, sizeof(response));
+        memcpy(response, payload, size < sizeof(response) ? size : sizeof(response) - 1);
+
+        replay_time = time / 1000000;
+        frames++;
+
+        const ups_status status = parse_frame(response, &sample);
+        if (status == INVALID_RESPONSE)
+            invalid++;
+
+        update_state(&machine, status, status != INVALID_RESPONSE ? &sample : NULL);
+    }
+
+    const uint64_t elapsed = get_time_ns() - started;
+
+    munmap((void*) data, st.st_size);
+
+    printf("frames=%" PRIu64 " invalid=%" PRIu64 " shutdowns=%" PRIu64 " elapsed=%" PRIu64 " ns rate=%.0f frames/s\n",
+           frames, invalid, replay_shutdowns, elapsed, elapsed ? frames * 1e9 / elapsed : 0.0);
+
+    return 0;
+}
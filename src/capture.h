@@ -0,0 +1,71 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Capture file starts with the magic and consists of records:
+ *      time (8 bytes, CLOCK_BOOTTIME nanoseconds), direction (1 byte),
+ *      reserved (1 byte), size (2 bytes), data (size bytes);
+ * All numbers are in host byte order.
+ */
+
+#define CAPTURE_MAGIC ("FSPCAP1\n")
+#define CAPTURE_MAGIC_SIZE (sizeof(CAPTURE_MAGIC) - 1)
+#define CAPTURE_RECORD_HEADER_SIZE (12)
+
+
+typedef enum {
+    CAPTURE_READ,  /* data read from the port */
+    CAPTURE_WRITE  /* data written to the port */
+}
+capture_direction;
+
+
+/*
+ * Open (create) the capture file and write the magic to a new file.
+ * Return 0 on success and >0 on error.
+ */
+int open_capture(const char *path);
+
+/*
+ * Append the data to the capture file, do nothing if it's not opened.
+ */
+void capture_data(const capture_direction direction, const void *data, const size_t size);
+
+/*
+ * Close the capture file.
+ */
+void close_capture(void);
+
+/*
+ * Feed all responses from the capture through the parser and the status machine
+ * using capture timestamps as the clock, `shutdown' is never run.
+ * Records are replayed with the original pauses or as fast as possible.
+ * Return 0 on success and >0 on error.
+ */
+int replay_capture(const char *path, const int fast, const unsigned int delay);
+
+
+#endif /* CAPTURE_H_ */
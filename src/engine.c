@@ -0,0 +1,519 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "faults.h"
+#include "log.h"
+#include "protocol.h"
+#include "stats.h"
+#include "uring.h"
+
+
+/*
+ * The event engine waits for the signal, the timer, the root helper socket and the responses
+ * from the ports, it reads the responses and the timer, so the event loop only processes them.
+ * The poll() engine makes a system call per port read and write, the io_uring engine submits
+ * all requests of a tick and reaps completions with one system call per wakeup.
+ */
+typedef struct {
+    const char *name;
+    int (*open)(void);
+    int (*wait)(const int helper_fd, engine_event *events);
+    int (*send)(const unsigned int port, const char *command);
+    void (*close)(void);
+}
+engine_ops;
+
+
+static int signal_fd = -1;
+static int tick_fd = -1;
+static const int *ports = NULL;
+static unsigned int ports_total = 0;
+static uint64_t read_timeout_ms = 0;
+
+static int awaited[ENGINE_MAX_PORTS];
+static char responses[ENGINE_MAX_PORTS][RESPONSE_SIZE];
+static uint64_t expirations = 0;  /* the timer value, the amount is not used */
+
+
+static void add_port_event(engine_event *event, const engine_event_type type, const unsigned int port)
+{
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->port = port;
+    event->response = responses[port];
+    awaited[port] = 0;
+}
+
+
+/*
+ * The poll() engine. The request is written right away because it is tiny and
+ * fits into the port output buffer, it saves one poll() per UPS status update.
+ * If the write fails the sample is missed and the request is repeated on the
+ * next tick, a hung up port reports POLLOUT forever and must never be polled
+ * for it. Ports are polled only while the response is awaited (negative
+ * descriptor is ignored by poll()). If the next timer event comes first, the
+ * sample is missed, so a silent UPS never stops polling.
+ */
+static struct pollfd fds[3 + ENGINE_MAX_PORTS];
+
+
+static int open_poll(void)
+{
+    fds[0].fd = signal_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = tick_fd;
+    fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
+
+    for (unsigned int i = 0; i < ports_total; i++)
+        fds[3 + i].events = POLLIN;
+
+    return 0;
+}
+
+
+static int wait_poll(const int helper_fd, engine_event *events)
+{
+    int count = 0;
+
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    fds[2].fd = helper_fd;
+    fds[2].revents = 0;
+
+    for (unsigned int i = 0; i < ports_total; i++) {
+        fds[3 + i].fd = awaited[i] ? ports[i] : -1;
+        fds[3 + i].revents = 0;
+    }
+
+    stats.syscalls++;
+
+    if (poll(fds, 3 + ports_total, -1) < 0)
+        return -1;
+
+    if (fds[0].revents & POLLIN)
+        events[count++].type = ENGINE_SIGNAL;
+
+    if (fds[2].revents) {
+        events[count].type = ENGINE_HELPER;
+        events[count++].revents = fds[2].revents;
+    }
+
+    for (unsigned int i = 0; i < ports_total; i++) {
+        struct pollfd *pfd = &(fds[3 + i]);
+
+        if (pfd->fd < 0)
+            continue;
+
+        pfd->revents = PORT_REVENTS(pfd->revents);
+
+        if (pfd->revents & POLLIN) {
+            engine_event *event = &(events[count++]);
+
+            add_port_event(event, ENGINE_RESPONSE, i);
+            memset(responses[i], 0, RESPONSE_SIZE);
+            stats.syscalls++;
+            event->size = PORT_READ(pfd->fd, responses[i], RESPONSE_SIZE - 1);
+            event->error = errno;
+        }
+        else if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            add_port_event(&(events[count]), ENGINE_PORT_ERROR, i);
+            events[count++].reason = "port error or hangup";
+        }
+    }
+
+    if (fds[1].revents & POLLIN) {
+        stats.syscalls++;
+        read(tick_fd, &expirations, sizeof(expirations));  /* we don't care about this data */
+        events[count++].type = ENGINE_TIMER;
+    }
+
+    return count;
+}
+
+
+static int send_poll(const unsigned int port, const char *command)
+{
+    if (send_request(ports[port], command))
+        return 1;
+
+    awaited[port] = 1;
+
+    return 0;
+}
+
+
+static void close_poll(void)
+{
+}
+
+
+/*
+ * The io_uring engine. The signal descriptor and the helper socket are polled
+ * and the timer is read by one-shot requests, they are submitted again after
+ * completion. The request to the port is linked with the response read and
+ * its timeout, the chain is submitted with the next wait. The read goes to the
+ * kernel worker right away (a blocking read of the port keeps the VMIN/VTIME
+ * framing of the poll() engine), the timeout cancels it before the next tick.
+ * Fault injection is not applied to this engine.
+ */
+typedef enum {
+    URING_SIGNAL = 1,
+    URING_HELPER,
+    URING_TIMER,
+    URING_WRITE,
+    URING_READ,
+    URING_TIMEOUT,
+    URING_CANCEL
+}
+uring_data;
+
+#define URING_DATA(kind, port) (((uint64_t) (kind) << 32) | (port))
+#define URING_ENTRIES (4 * ENGINE_MAX_PORTS + 8)  /* a chain and a cancel per port, three rearms */
+
+
+static const unsigned char uring_ops[] = {
+    IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL
+};
+
+static int signal_armed = 0;
+static int timer_armed = 0;
+static int helper_armed = -1;  /* the helper socket being polled */
+static int helper_canceled = 0;
+static unsigned int inflight[ENGINE_MAX_PORTS];  /* completions to come for the port */
+static char requests[ENGINE_MAX_PORTS][REQUEST_SIZE + 1];
+static struct __kernel_timespec read_timeout;
+static engine_event port_events[ENGINE_MAX_PORTS];
+
+
+static void prep_poll(struct io_uring_sqe *sqe, const int fd, const uring_data kind)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATA(kind, 0);
+}
+
+
+static void prep_cancel(struct io_uring_sqe *sqe, const uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_DATA(URING_CANCEL, 0);
+}
+
+
+static int open_io_uring(void)
+{
+    if (open_uring(URING_ENTRIES, uring_ops, sizeof(uring_ops)))
+        return 1;
+
+    signal_armed = 0;
+    timer_armed = 0;
+    helper_armed = -1;
+    helper_canceled = 0;
+    memset(inflight, 0, sizeof(inflight));
+
+    read_timeout.tv_sec = read_timeout_ms / 1000;
+    read_timeout.tv_nsec = read_timeout_ms % 1000 * 1000000;
+
+    return 0;
+}
+
+
+/*
+ * Submit again the requests completed on the last wait.
+ */
+static void rearm(const int helper_fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!signal_armed && (sqe = get_sqe()) != NULL) {
+        prep_poll(sqe, signal_fd, URING_SIGNAL);
+        signal_armed = 1;
+    }
+
+    if (!timer_armed && (sqe = get_sqe()) != NULL) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = tick_fd;
+        sqe->addr = (uintptr_t) &expirations;
+        sqe->len = sizeof(expirations);
+        sqe->user_data = URING_DATA(URING_TIMER, 0);
+        timer_armed = 1;
+    }
+
+    if (helper_armed < 0 && helper_fd >= 0 && (sqe = get_sqe()) != NULL) {
+        prep_poll(sqe, helper_fd, URING_HELPER);
+        helper_armed = helper_fd;
+        helper_canceled = 0;
+    }
+    else if (helper_armed >= 0 && helper_fd != helper_armed && !helper_canceled && (sqe = get_sqe()) != NULL) {
+        prep_cancel(sqe, URING_DATA(URING_HELPER, 0));  /* the helper is lost */
+        helper_canceled = 1;
+    }
+}
+
+
+static int wait_io_uring(const int helper_fd, engine_event *events)
+{
+    struct io_uring_cqe *cqe;
+    int count = 0;
+    unsigned int ports_count = 0;
+    int signal = 0;
+    short helper_revents = 0;
+    int timer = 0;
+
+    rearm(helper_fd);
+
+    if (enter_uring(peek_cqe() == NULL))
+        return -1;
+
+    while ((cqe = peek_cqe()) != NULL) {
+        const uring_data kind = cqe->user_data >> 32;
+        const unsigned int port = cqe->user_data & 0xffffffff;
+        const int res = cqe->res;
+
+        seen_cqe();
+
+        switch (kind) {
+            case URING_SIGNAL:
+                signal_armed = 0;
+                if (res < 0)
+                    LOG_E("unable to poll signalfd, error %d", res);
+                else
+                    signal = 1;
+                break;
+
+            case URING_HELPER:
+                if (res > 0 && helper_fd == helper_armed)
+                    helper_revents |= res;
+                helper_armed = -1;
+                break;
+
+            case URING_TIMER:
+                timer_armed = 0;
+                if (res < 0)
+                    LOG_E("unable to read timerfd, error %d", res);
+                else
+                    timer = 1;
+                break;
+
+            case URING_WRITE:
+                inflight[port]--;
+                if (res == REQUEST_SIZE) {
+                    request_written(ports[port], requests[port], REQUEST_SIZE);
+                }
+                else if (awaited[port]) {
+                    errno = res < 0 ? -res : EIO;
+                    LOG_E("unable to send request, error '%m'");
+                    add_port_event(&(port_events[ports_count]), ENGINE_PORT_ERROR, port);
+                    port_events[ports_count++].reason = "unable to send request";
+                }
+                break;
+
+            case URING_READ:
+                inflight[port]--;
+                /* the timeout keeps the response awaited, the sample is missed on the next tick */
+                if (!awaited[port] || res == -ECANCELED || res == -EINTR || res == -ETIME)
+                    break;
+                if (res < 0) {
+                    add_port_event(&(port_events[ports_count]), ENGINE_PORT_ERROR, port);
+                    port_events[ports_count++].reason = "port error or hangup";
+                }
+                else {
+                    add_port_event(&(port_events[ports_count]), ENGINE_RESPONSE, port);
+                    port_events[ports_count++].size = res;
+                }
+                break;
+
+            case URING_TIMEOUT:
+                inflight[port]--;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (signal)
+        events[count++].type = ENGINE_SIGNAL;
+
+    if (helper_revents) {
+        events[count].type = ENGINE_HELPER;
+        events[count++].revents = helper_revents;
+    }
+
+    for (unsigned int i = 0; i < ports_count; i++)
+        events[count++] = port_events[i];
+
+    if (timer)
+        events[count++].type = ENGINE_TIMER;
+
+    return count;
+}
+
+
+static int send_io_uring(const unsigned int port, const char *command)
+{
+    struct io_uring_sqe *sqe;
+
+    awaited[port] = 0;
+
+    /* the response buffer is still used by the kernel */
+    if (inflight[port]) {
+        LOG_E("unable to send request, the previous one is still in flight");
+        if ((sqe = get_sqe()) != NULL)
+            prep_cancel(sqe, URING_DATA(URING_READ, port));
+        return 1;
+    }
+
+    if (free_sqes() < 3) {
+        LOG_E("unable to send request, io_uring submission queue is full");
+        return 1;
+    }
+
+    const size_t size = format_request(requests[port], command);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = ports[port];
+    sqe->off = -1;  /* the port is not seekable */
+    sqe->addr = (uintptr_t) requests[port];
+    sqe->len = size;
+    sqe->user_data = URING_DATA(URING_WRITE, port);
+
+    memset(responses[port], 0, RESPONSE_SIZE);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_ASYNC;
+    sqe->fd = ports[port];
+    sqe->off = -1;
+    sqe->addr = (uintptr_t) responses[port];
+    sqe->len = RESPONSE_SIZE - 1;
+    sqe->user_data = URING_DATA(URING_READ, port);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &read_timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(URING_TIMEOUT, port);
+
+    inflight[port] = 3;
+    awaited[port] = 1;
+
+    return 0;
+}
+
+
+static const engine_ops poll_engine = {
+    .name = "poll",
+    .open = open_poll,
+    .wait = wait_poll,
+    .send = send_poll,
+    .close = close_poll
+};
+
+static const engine_ops uring_engine = {
+    .name = "uring",
+    .open = open_io_uring,
+    .wait = wait_io_uring,
+    .send = send_io_uring,
+    .close = close_uring
+};
+
+static const engine_ops *engine = &poll_engine;
+
+
+int open_engine(const char *name, const int sig_fd, const int timer_fd,
+                const int *port_fds, const unsigned int ports_count, const unsigned int interval_ms)
+{
+    if (ports_count > ENGINE_MAX_PORTS) {
+        LOG_E("too many ports %u, max %u", ports_count, ENGINE_MAX_PORTS);
+        return 1;
+    }
+
+    if (!strcmp(name, "poll"))
+        engine = &poll_engine;
+    else if (!strcmp(name, "uring"))
+        engine = &uring_engine;
+    else {
+        LOG_E("unknown event engine '%s'", name);
+        return 1;
+    }
+
+    signal_fd = sig_fd;
+    tick_fd = timer_fd;
+    ports = port_fds;
+    ports_total = ports_count;
+    read_timeout_ms = (uint64_t) interval_ms * 9 / 10;
+    memset(awaited, 0, sizeof(awaited));
+
+    if (engine->open()) {
+        if (engine == &poll_engine)
+            return 1;
+        LOG_I("io_uring is not available, falling back to poll()");
+        engine = &poll_engine;
+        if (engine->open())
+            return 1;
+    }
+
+    LOG_I("event engine '%s' is used", engine->name);
+
+    return 0;
+}
+
+
+int wait_events(const int helper_fd, engine_event *events)
+{
+    return engine->wait(helper_fd, events);
+}
+
+
+int send_port_request(const unsigned int port, const char *command)
+{
+    return engine->send(port, command);
+}
+
+
+int is_response_awaited(const unsigned int port)
+{
+    return awaited[port];
+}
+
+
+const char *get_engine_name(void)
+{
+    return engine->name;
+}
+
+
+void close_engine(void)
+{
+    engine->close();
+}
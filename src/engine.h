@@ -0,0 +1,90 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <sys/types.h>
+
+
+#define ENGINE_MAX_PORTS (64)  /* the daemon uses up to MAX_FEEDS ports, the benchmark uses more */
+#define ENGINE_MAX_EVENTS (3 + ENGINE_MAX_PORTS)  /* at most one event per descriptor per wait */
+
+
+typedef enum {
+    ENGINE_SIGNAL,  /* the signal descriptor is readable */
+    ENGINE_HELPER,  /* the root helper socket has events */
+    ENGINE_RESPONSE,  /* the response has been read from the port */
+    ENGINE_PORT_ERROR,  /* the request has failed, no response is awaited */
+    ENGINE_TIMER  /* the timer has expired, it has been read already */
+}
+engine_event_type;
+
+
+/*
+ * Events are returned in the order of processing: signal, helper, ports, timer.
+ */
+typedef struct {
+    engine_event_type type;
+    unsigned int port;  /* index of the port for port events */
+    short revents;  /* poll events of the helper socket */
+    ssize_t size;  /* result of the response read, <= 0 on error */
+    int error;  /* errno of the failed response read */
+    char *response;  /* zero terminated response, valid until the next request to the port */
+    const char *reason;  /* reason of the port error */
+}
+engine_event;
+
+
+/*
+ * Set up the event engine "poll" or "uring" for the descriptors, all of them must stay open until `close_engine()'.
+ * The io_uring engine falls back to poll() if the kernel does not support it. Requests are canceled
+ * by the io_uring engine if there is no response in 9/10 of `interval_ms'.
+ * Return 0 on success and >0 on error.
+ */
+int open_engine(const char *name, const int sig_fd, const int timer_fd,
+                const int *port_fds, const unsigned int ports_count, const unsigned int interval_ms);
+
+/*
+ * Wait for events (the root helper socket is not watched if `helper_fd' is negative), store them to `events'
+ * of ENGINE_MAX_EVENTS size.
+ * Return amount of events (may be 0) or -1 with errno set on error.
+ */
+int wait_events(const int helper_fd, engine_event *events);
+
+/*
+ * Send the status request to the port (the io_uring engine only queues it until the next wait),
+ * the previous request is not awaited anymore.
+ * Return 0 on success and >0 on error.
+ */
+int send_port_request(const unsigned int port, const char *command);
+
+/*
+ * Return 1 if the response to the last request of the port is still awaited and 0 otherwise.
+ */
+int is_response_awaited(const unsigned int port);
+
+/*
+ * Return the name of the engine in use.
+ */
+const char *get_engine_name(void);
+
+void close_engine(void);
+
+
+#endif /* ENGINE_H_ */
@@ -0,0 +1,267 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef FAULTS
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "faults.h"
+#include "log.h"
+#include "policy.h"
+
+
+#define FAULTS_ENV ("FSPUPSMON_FAULTS")
+#define STASH_SIZE (256)
+
+
+typedef enum {
+    FAULT_DELAY,
+    FAULT_TRUNCATE,
+    FAULT_SPLIT,
+    FAULT_FLIP,
+    FAULT_EIO,
+    FAULT_EAGAIN,
+    FAULT_HANGUP,
+    FAULTS_COUNT
+}
+fault_type;
+
+
+static const char *fault_names[FAULTS_COUNT] = {
+    "delay",
+    "truncate",
+    "split",
+    "flip",
+    "eio",
+    "eagain",
+    "hangup"
+};
+
+static double probabilities[FAULTS_COUNT];
+static uint64_t injected[FAULTS_COUNT];
+static unsigned int seed = 1;
+static unsigned int delay_ms = 1000;
+
+typedef struct {
+    int fd;  /* port the data belongs to, -1 if the slot is free */
+    size_t size;
+    char data[STASH_SIZE];  /* the rest of split response */
+}
+stash_t;
+
+
+static stash_t stashes[MAX_FEEDS];  /* one per port */
+
+
+/*
+ * Decide whether to inject the fault now.
+ */
+static int inject(const fault_type fault)
+{
+    if (probabilities[fault] <= 0.0 || (double) rand_r(&seed) / RAND_MAX >= probabilities[fault])
+        return 0;
+
+    injected[fault]++;
+    LOG_D("fault '%s' injected", fault_names[fault]);
+
+    return 1;
+}
+
+
+int init_faults(void)
+{
+    char schedule[256];
+    char *saveptr = NULL;
+
+    for (int i = 0; i < MAX_FEEDS; i++)
+        stashes[i].fd = -1;
+
+    const char *env = getenv(FAULTS_ENV);
+    if (env == NULL)
+        return 0;
+
+    if (strlen(env) >= sizeof(schedule)) {
+        LOG_E("fault schedule is too long");
+        return 1;
+    }
+
+    strcpy(schedule, env);
+
+    for (char *item = strtok_r(schedule, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(item, '=');
+        int found = 0;
+
+        if (value == NULL) {
+            LOG_E("invalid fault schedule item '%s'", item);
+            return 1;
+        }
+
+        *(value++) = '\0';
+
+        if (!strcmp(item, "seed")) {
+            seed = strtoul(value, NULL, 10);
+            continue;
+        }
+
+        if (!strcmp(item, "delay_ms")) {
+            delay_ms = strtoul(value, NULL, 10);
+            continue;
+        }
+
+        for (int i = 0; i < FAULTS_COUNT; i++)
+            if (!strcmp(item, fault_names[i])) {
+                probabilities[i] = strtod(value, NULL);
+                found = 1;
+            }
+
+        if (!found) {
+            LOG_E("unknown fault '%s'", item);
+            return 1;
+        }
+    }
+
+    LOG_I("fault injection schedule '%s'", env);
+
+    return 0;
+}
+
+
+/*
+ * Find the stash of the port or a free one.
+ * Return NULL if all stashes are used by other ports.
+ */
+static stash_t* find_stash(const int fd)
+{
+    stash_t *free_stash = NULL;
+
+    for (int i = 0; i < MAX_FEEDS; i++) {
+        if (stashes[i].fd == fd)
+            return &(stashes[i]);
+        if (stashes[i].fd < 0 && free_stash == NULL)
+            free_stash = &(stashes[i]);
+    }
+
+    return free_stash;
+}
+
+
+ssize_t fault_read(const int fd, void *buf, const size_t size)
+{
+    char *data = buf;
+    stash_t *stash = find_stash(fd);
+
+    if (stash != NULL && stash->fd == fd) {
+        const size_t count = stash->size < size ? stash->size : size;
+
+        memcpy(data, stash->data, count);
+        memmove(stash->data, stash->data + count, stash->size - count);
+        stash->size -= count;
+
+        if (!stash->size)
+            stash->fd = -1;
+
+        return count;
+    }
+
+    if (inject(FAULT_EAGAIN)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (inject(FAULT_DELAY)) {
+        const struct timespec delay = {
+            .tv_sec = delay_ms / 1000,
+            .tv_nsec = (delay_ms % 1000) * 1000000L
+        };
+
+        nanosleep(&delay, NULL);
+    }
+
+    ssize_t count = read(fd, data, size);
+    if (count <= 1)
+        return count;
+
+    if (inject(FAULT_EIO)) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (inject(FAULT_FLIP))
+        data[rand_r(&seed) % count] ^= 1 << (rand_r(&seed) % 8);
+
+    if (inject(FAULT_TRUNCATE)) {
+        const size_t first = 1 + rand_r(&seed) % (count - 1);
+
+        memset(data + first, 0, count - first);  /* the rest has never arrived */
+        count = first;
+    }
+    else if (stash != NULL && inject(FAULT_SPLIT)) {
+        const size_t first = 1 + rand_r(&seed) % (count - 1);
+
+        stash->fd = fd;
+        stash->size = count - first < STASH_SIZE ? count - first : STASH_SIZE;
+        memcpy(stash->data, data + first, stash->size);
+        memset(data + first, 0, count - first);
+        count = first;
+    }
+
+    return count;
+}
+
+
+ssize_t fault_write(const int fd, const void *buf, const size_t size)
+{
+    if (inject(FAULT_EAGAIN)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (inject(FAULT_EIO)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return write(fd, buf, size);
+}
+
+
+short fault_revents(const short revents)
+{
+    if (inject(FAULT_HANGUP))
+        return POLLHUP;
+
+    return revents;
+}
+
+
+void dump_faults(void)
+{
+    LOG_I("faults: delay=%" PRIu64 ", truncate=%" PRIu64 ", split=%" PRIu64 ", flip=%" PRIu64
+          ", eio=%" PRIu64 ", eagain=%" PRIu64 ", hangup=%" PRIu64,
+          injected[FAULT_DELAY], injected[FAULT_TRUNCATE], injected[FAULT_SPLIT], injected[FAULT_FLIP],
+          injected[FAULT_EIO], injected[FAULT_EAGAIN], injected[FAULT_HANGUP]);
+}
+
+#endif /* FAULTS */
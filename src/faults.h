@@ -0,0 +1,74 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FAULTS_H_
+#define FAULTS_H_
+
+
+/*
+ * Fault injection into port I/O for stress testing, compiled in with `make FAULTS=1'.
+ * The schedule is taken from FSPUPSMON_FAULTS environment variable, e.g.:
+ *      FSPUPSMON_FAULTS="seed=1,delay=0.01,delay_ms=1500,truncate=0.02,split=0.02,flip=0.01,eio=0.01,eagain=0.01,hangup=0.005"
+ * Each fault is injected with the given probability per port operation:
+ *      delay - sleep for `delay_ms' before reading the response;
+ *      truncate - return the first part of the response and lose the rest;
+ *      split - return the first part of the response, the rest is returned by the next read;
+ *      flip - flip random bit of the response;
+ *      eio - fail reading or writing with EIO, the data is lost;
+ *      eagain - fail reading or writing with EAGAIN, the data stays in the port;
+ *      hangup - report POLLHUP on the port.
+ */
+
+#ifdef FAULTS
+
+#include <poll.h>
+#include <sys/types.h>
+
+/*
+ * Parse the schedule from the environment.
+ * Return 0 on success and >0 on error.
+ */
+int init_faults(void);
+
+ssize_t fault_read(const int fd, void *buf, const size_t size);
+ssize_t fault_write(const int fd, const void *buf, const size_t size);
+short fault_revents(const short revents);
+
+/*
+ * Write amounts of injected faults to the log.
+ */
+void dump_faults(void);
+
+#define PORT_READ(fd, buf, size) fault_read(fd, buf, size)
+#define PORT_WRITE(fd, buf, size) fault_write(fd, buf, size)
+#define PORT_REVENTS(revents) fault_revents(revents)
+
+#else
+
+#define init_faults() (0)
+#define dump_faults() do {} while (0)
+
+#define PORT_READ(fd, buf, size) read(fd, buf, size)
+#define PORT_WRITE(fd, buf, size) write(fd, buf, size)
+#define PORT_REVENTS(revents) (revents)
+
+#endif
+
+
+#endif /* FAULTS_H_ */
@@ -0,0 +1,269 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "history.h"
+
+
+typedef enum {
+    FILE_SAMPLES,
+    FILE_MINUTES,
+    FILE_HOURS,
+    FILES_COUNT
+}
+history_file;
+
+
+static const char *file_suffixes[FILES_COUNT] = {
+    "",
+    HISTORY_MINUTE_SUFFIX,
+    HISTORY_HOUR_SUFFIX
+};
+
+static const size_t record_sizes[FILES_COUNT] = {
+    sizeof(history_sample),
+    sizeof(history_rollup),
+    sizeof(history_rollup)
+};
+
+static const uint64_t rollup_periods[FILES_COUNT] = {
+    0,
+    60 * 1000,
+    60 * 60 * 1000
+};
+
+
+static int fds[FILES_COUNT] = {-1, -1, -1};
+static history_rollup rollups[FILES_COUNT];  /* current periods, the first one is unused */
+static uint64_t last_time = 0;  /* time of the last sample, used to keep records sorted */
+
+
+/*
+ * Open the history file, write the header to a new file or validate the existing one.
+ * Incomplete record at the end (if any) is truncated.
+ * Return the descriptor on success and -1 on error.
+ */
+static int open_file(const char *path, const size_t record_size)
+{
+    struct stat st;
+    history_header header;
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_E("unable to open history file '%s', error '%m'", path);
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        LOG_E("unable to stat history file '%s', error '%m'", path);
+        goto on_error;
+    }
+
+    if (!st.st_size) {
+        header.magic = HISTORY_MAGIC;
+        header.version = HISTORY_VERSION;
+        header.record_size = record_size;
+
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            LOG_E("unable to write header to history file '%s', error '%m'", path);
+            goto on_error;
+        }
+
+        return fd;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != HISTORY_MAGIC
+            || header.version != HISTORY_VERSION
+            || header.record_size != record_size) {
+        LOG_E("invalid header in history file '%s'", path);
+        goto on_error;
+    }
+
+    const off_t tail = (st.st_size - sizeof(header)) % record_size;
+
+    if (tail) {
+        LOG_I("truncating incomplete record (%jd bytes) in history file '%s'", (intmax_t) tail, path);
+        if (ftruncate(fd, st.st_size - tail)) {
+            LOG_E("unable to truncate history file '%s', error '%m'", path);
+            goto on_error;
+        }
+    }
+
+    return fd;
+
+on_error:
+
+    if (close(fd))
+        LOG_E("unable to close history file '%s', error '%m'", path);
+
+    return -1;
+}
+
+
+/*
+ * Add the value to the rollup statistics, NAN values are skipped.
+ */
+static void add_value(rollup_stats *stats, const float value)
+{
+    if (isnan(value))
+        return;
+
+    if (!stats->count || value < stats->min)
+        stats->min = value;
+
+    if (!stats->count || value > stats->max)
+        stats->max = value;
+
+    stats->sum += value;
+    stats->count++;
+}
+
+
+/*
+ * Write the rollup to its file if it's not empty.
+ */
+static void flush_rollup(const history_file file)
+{
+    history_rollup *rollup = &(rollups[file]);
+
+    if (!rollup->samples)
+        return;
+
+    if (write(fds[file], rollup, sizeof(*rollup)) != sizeof(*rollup))
+        LOG_E("unable to write rollup to history, error '%m'");
+
+    memset(rollup, 0, sizeof(*rollup));
+}
+
+
+int open_history(const char *path)
+{
+    char name[PATH_MAX];
+
+    for (int i = 0; i < FILES_COUNT; i++) {
+        if (snprintf(name, sizeof(name), "%s%s", path, file_suffixes[i]) >= (int) sizeof(name)) {
+            LOG_E("history file name '%s' is too long", path);
+            goto on_error;
+        }
+
+        fds[i] = open_file(name, record_sizes[i]);
+        if (fds[i] < 0)
+            goto on_error;
+    }
+
+    const off_t size = lseek(fds[FILE_SAMPLES], 0, SEEK_END);
+
+    if (size > (off_t) sizeof(history_header)
+            && pread(fds[FILE_SAMPLES], &last_time, sizeof(last_time), size - sizeof(history_sample)) != sizeof(last_time)) {
+        LOG_E("unable to read last sample from history '%s', error '%m'", path);
+        goto on_error;
+    }
+
+    memset(rollups, 0, sizeof(rollups));
+
+    LOG_I("history '%s' opened", path);
+
+    return 0;
+
+on_error:
+
+    close_history();
+
+    return 1;
+}
+
+
+void write_history(const ups_sample *sample)
+{
+    struct timespec tm;
+
+    if (fds[FILE_SAMPLES] < 0)
+        return;
+
+    if (clock_gettime(CLOCK_REALTIME, &tm)) {
+        LOG_E("unable to get current time, error '%m'");
+        return;
+    }
+
+    uint64_t time = (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+
+    if (time < last_time)
+        time = last_time;  /* wall clock went backwards, keep records sorted */
+    last_time = time;
+
+    const history_sample record = {
+        .time = time,
+        .input_voltage = sample->input_voltage,
+        .fault_voltage = sample->fault_voltage,
+        .output_voltage = sample->output_voltage,
+        .load = sample->load,
+        .frequency = sample->frequency,
+        .battery_voltage = sample->battery_voltage,
+        .temperature = sample->temperature,
+        .flags = sample->flags
+    };
+
+    if (write(fds[FILE_SAMPLES], &record, sizeof(record)) != sizeof(record))
+        LOG_E("unable to write sample to history, error '%m'");
+
+    for (int i = FILE_MINUTES; i < FILES_COUNT; i++) {
+        history_rollup *rollup = &(rollups[i]);
+        const uint64_t start = time - time % rollup_periods[i];
+
+        if (rollup->time != start)
+            flush_rollup(i);
+
+        rollup->time = start;
+        rollup->samples++;
+        if (sample->flags & UPS_FLAG_UTILITY_FAIL)
+            rollup->offline++;
+
+        add_value(&(rollup->values[ROLLUP_INPUT_VOLTAGE]), sample->input_voltage);
+        add_value(&(rollup->values[ROLLUP_OUTPUT_VOLTAGE]), sample->output_voltage);
+        add_value(&(rollup->values[ROLLUP_BATTERY_VOLTAGE]), sample->battery_voltage);
+        add_value(&(rollup->values[ROLLUP_LOAD]), sample->load);
+        add_value(&(rollup->values[ROLLUP_TEMPERATURE]), sample->temperature);
+    }
+}
+
+
+void close_history(void)
+{
+    for (int i = 0; i < FILES_COUNT; i++) {
+        if (fds[i] < 0)
+            continue;
+
+        flush_rollup(i);  /* incomplete period is merged with the next one by the reader */
+
+        if (close(fds[i]))
+            LOG_E("unable to close history file #%d, error '%m'", fds[i]);
+
+        fds[i] = -1;
+    }
+}
@@ -0,0 +1,111 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+
+/*
+ * History consists of three files with the same layout:
+ *      <FILE>      - raw samples (history_sample);
+ *      <FILE>.1m   - per-minute rollups (history_rollup);
+ *      <FILE>.1h   - per-hour rollups (history_rollup);
+ * Each file starts with the header followed by fixed size records sorted by time,
+ * so they can be mapped into memory and searched by time with binary search.
+ */
+
+#define HISTORY_MAGIC (0x48505346)  /* 'FSPH' */
+#define HISTORY_VERSION (1)
+
+#define HISTORY_MINUTE_SUFFIX (".1m")
+#define HISTORY_HOUR_SUFFIX (".1h")
+
+
+typedef struct {
+    uint32_t magic;  /* HISTORY_MAGIC */
+    uint16_t version;  /* HISTORY_VERSION */
+    uint16_t record_size;  /* size of each record */
+}
+history_header;
+
+
+typedef struct {
+    uint64_t time;  /* wall clock time, milliseconds since Epoch */
+    float input_voltage;
+    float fault_voltage;
+    float output_voltage;
+    float load;
+    float frequency;
+    float battery_voltage;
+    float temperature;
+    uint32_t flags;
+}
+history_sample;
+
+
+typedef enum {
+    ROLLUP_INPUT_VOLTAGE,
+    ROLLUP_OUTPUT_VOLTAGE,
+    ROLLUP_BATTERY_VOLTAGE,
+    ROLLUP_LOAD,
+    ROLLUP_TEMPERATURE,
+    ROLLUP_VALUES_COUNT
+}
+rollup_value;
+
+
+typedef struct {
+    float min, max, sum;  /* sum is divided by count to get average */
+    uint32_t count;  /* amount of non-NAN values */
+}
+rollup_stats;
+
+
+typedef struct {
+    uint64_t time;  /* start of the period, milliseconds since Epoch */
+    uint32_t samples;  /* amount of samples in the period */
+    uint32_t offline;  /* amount of samples when UPS was offline */
+    rollup_stats values[ROLLUP_VALUES_COUNT];
+}
+history_rollup;
+
+
+/*
+ * Open (create) history files with the given base name.
+ * Return 0 on success and >0 on error.
+ */
+int open_history(const char *path);
+
+/*
+ * Append the sample to the history and update rollups.
+ * Do nothing if the history is not opened.
+ */
+void write_history(const ups_sample *sample);
+
+/*
+ * Flush incomplete rollups and close history files.
+ */
+void close_history(void);
+
+
+#endif /* HISTORY_H_ */
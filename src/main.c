@@ -20,172 +20,316 @@
 */
 
 #include <poll.h>
+#include <errno.h>
 #include <time.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
-
+#include <termios.h>
+
+#include "actions.h"
+#include "alerts.h"
+#include "battery.h"
+#include "capture.h"
+#include "engine.h"
+#include "faults.h"
+#include "history.h"
 #include "log.h"
+#include "once.h"
+#include "pipeline.h"
+#include "policy.h"
 #include "port.h"
 #include "privileges.h"
+#include "probes.h"
+#include "probe.h"
 #include "protocol.h"
+#include "quality.h"
+#include "realtime.h"
 #include "signals.h"
+#include "state.h"
+#include "stats.h"
+#include "status.h"
+#include "subscribers.h"
 #include "timer.h"
 
 
 /*
- * Update UPS status and run `shutdown' if UPS is offline for too long.
- * Return:
- *          -1 on error;
- *          0 if the system is going to shutdown;
- *          1 if UPS is online;
+ * Decode UPS status of the feed from the response, pass it to the export thread, evaluate the shutdown rules,
+ * then update the status machine with the result.
+ * Return the result of `update_state()'.
  */
-static int update_status(const int fd, const unsigned int delay)
+static int update_status(const int fd, const engine_event *event, status_machine *machine)
 {
-    static uint64_t prev_time = 0;
+    ups_sample sample;
+    policy_result result;
 
-    ups_status status = parse_response(fd);
+    errno = event->error;  /* the response has been read by the engine */
 
-    switch (status) {
-        case UPS_ONLINE:
-            if (prev_time) {
-                LOG_I("UPS became online, system shutdown canceled");
-                prev_time = 0;
-            }
-            else
-                LOG_D("UPS is online");
-            return 1;
+    ups_status status = decode_response(fd, event->response, event->size, &sample);
 
-        case UPS_OFFLINE:
-            break;
+    if (status == INVALID_RESPONSE)
+        stats.invalid_responses++;
 
-        default:
-            return -1;
-    }
+    push_sample(event->port, status, status != INVALID_RESPONSE ? &sample : NULL);
 
-    struct timespec tm;
+    update_policy(event->port, status, status != INVALID_RESPONSE ? &sample : NULL, &result);
 
-    if (clock_gettime(CLOCK_MONOTONIC, &tm)) {
-        LOG_E("unable to get current time, error '%m'");
-        return -1;
-    }
+    if (result.changed && result.feeds > 1)
+        push_policy(&result);
 
-    uint64_t cur_time = tm.tv_sec;
+    const int ret = update_state(machine, result.status, result.sample);
 
-    if (!prev_time) {
-        prev_time = cur_time;
-        LOG_I("UPS became offline, %u sec left before system shutdown", delay);
-        return 1;
-    }
-
-    uint64_t delta = cur_time - prev_time;
+    save_state(machine, result.status);
 
-    if (delta < (uint64_t) delay) {
-        LOG_I("UPS is offline, %" PRIu64 " sec left before system shutdown", delay - delta);
-        return 1;
-    }
+    return ret;
+}
 
-    prev_time = 0;
-    LOG_I("shutdown delay is over, going to shutdown system");
 
-    if (set_root_privileges())  /* return root privileges back in order to run `shutdown' */
-        return -1;
+/*
+ * Account the sample of the feed which has not been received, subscribers see UPS status as invalid.
+ * The policy counts the feed as lost if it keeps missing samples.
+ */
+static void miss_sample(const unsigned int feed, const char *reason)
+{
+    policy_result result;
 
-    int ret = system("shutdown");
-    if (ret)
-        LOG_E("unable to execute command 'shutdown', ret=%d, error='%m'", ret);
-    else
-        LOG_I("shutdown in progress, 1 minute left");
+    stats.missed_samples++;
+    LOG_E("UPS #%u sample missed, %s", feed, reason);
+    push_sample(feed, INVALID_RESPONSE, NULL);
 
-    set_user_privileges();  /* drop privileges back to the user */
+    update_policy(feed, INVALID_RESPONSE, NULL, &result);
 
-    return ret;
+    if (result.changed && result.feeds > 1)
+        push_policy(&result);
 }
 
 
 /*
- * Process events from descriptors.
+ * Process events from the engine.
+ * Return 0 on quit signal or shutdown and >0 on error.
  */
-static void process_events(const int sig_fd, const int port_fd, const int timer_fd, const unsigned int delay)
+static int process_events(const int sig_fd, const int *port_fds, const char **requests, const unsigned int ports_count,
+                          status_machine *machine, const int debug_mode)
 {
-    int sleeping = 1;
-    uint64_t unused = 0;
-    struct pollfd fds[2];
-
-    fds[0].fd = sig_fd;
-    fds[0].events = POLLIN;
-
-    /*
-     * This element is used for two purposes:
-     *      1) to make delays between UPS status updates;
-     *      2) to read and process current UPS status;
-     * First we wait for a timer event. Then we update UPS status. And repeat.
-     */
-    fds[1].fd = timer_fd;
-    fds[1].events = POLLIN;
+    int stale[MAX_FEEDS] = {0};  /* the port may contain remains of previous response */
+    engine_event events[ENGINE_MAX_EVENTS];
 
     LOG_I("start processing events");
 
     for (;;) {
-        fds[0].revents = 0;
-        fds[1].revents = 0;
+        short wake_revents = 0;
+        short ports_revents = 0;
 
-        if (poll(fds, (sizeof(fds) / sizeof(fds[0])), -1) < 0) {
-            LOG_E("poll() return error '%m'");
-            continue;
+        /* the root helper socket (if any) is watched to report the helper death right away, not when the shutdown is due */
+        const int count = wait_events(get_helper_fd(), events);  /* -1 once the helper is lost */
+
+        if (count < 0) {
+            stats.poll_errors++;
+            if (errno == EINTR)
+                continue;
+            LOG_E("waiting for events return error '%m'");
+            return 1;
         }
 
-        if (fds[0].revents & POLLIN) {
-            if (!check_quit_signal(sig_fd))
-                break;
+        const uint64_t start = get_time_ns();
+
+        stats.iterations++;
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].type == ENGINE_SIGNAL)
+                wake_revents = POLLIN;
+            else if (events[i].type == ENGINE_RESPONSE || events[i].type == ENGINE_TIMER)
+                ports_revents |= POLLIN;
+            else if (events[i].type == ENGINE_PORT_ERROR)
+                ports_revents |= POLLERR;
         }
 
-        if (fds[1].revents & POLLIN) {
-            if (sleeping) {
-                read(timer_fd, &unused, sizeof(unused));  /* we don't care about this data */
-                fds[1].fd = port_fd;
-                fds[1].events = POLLOUT;
-                sleeping = 0;
-            }
-            else {
-                if (!update_status(port_fd, delay))
+        PROBE3(wake, stats.iterations, wake_revents, ports_revents);
+        (void) wake_revents;  /* the probes may be compiled out */
+        (void) ports_revents;
+
+        for (int i = 0; i < count; i++) {
+            const engine_event *event = &(events[i]);
+
+            switch (event->type) {
+                case ENGINE_SIGNAL: {
+                    stats.wakes[WAKE_SIGNAL]++;
+                    stats.syscalls++;
+
+                    const int ret = check_quit_signal(sig_fd);
+                    if (!ret)
+                        goto on_quit;
+                    if (ret == 2) {
+                        dump_stats();
+                        dump_faults();
+                        dump_policy();
+                        push_dump();
+                    }
+                    break;
+                }
+
+                case ENGINE_HELPER:
+                    check_helper(event->revents);
+                    break;
+
+                case ENGINE_RESPONSE: {
+                    stats.wakes[WAKE_PORT_IN]++;
+
+                    const uint64_t update_start = get_time_ns();
+                    const int ret = update_status(port_fds[event->port], event, machine);
+
+                    stats.updates++;
+                    stats_account(&stats.update_ns_total, &stats.update_ns_max, update_start);
+
+                    if (debug_mode)
+                        check_allocations();
+
+                    if (!ret)
+                        goto on_quit;
+
+                    stale[event->port] = ret < 0;
                     break;
-                fds[1].fd = timer_fd;
-                fds[1].events = POLLIN;
-                sleeping = 1;
+                }
+
+                case ENGINE_PORT_ERROR:
+                    miss_sample(event->port, event->reason);
+                    stale[event->port] = 1;
+                    break;
+
+                case ENGINE_TIMER: {
+                    stats.wakes[WAKE_TIMER]++;
+                    stats_tick(start);
+                    reap_actions();
+
+                    const int test_feed = get_battery_test(!machine->offline_since && all_feeds_online());
+
+                    /*
+                     * The request is sent on every timer event. If the next timer event comes
+                     * before the response, the sample is missed, so a silent UPS never stops polling.
+                     */
+                    for (unsigned int j = 0; j < ports_count; j++) {
+                        if (is_response_awaited(j)) {
+                            miss_sample(j, "no response in time");
+                            stale[j] = 1;
+                        }
+
+                        if (stale[j]) {
+                            stats.syscalls++;
+                            tcflush(port_fds[j], TCIFLUSH);
+                            stale[j] = 0;
+                        }
+
+                        if ((int) j == test_feed) {
+                            LOG_I("starting battery self-test of UPS #%u", j);
+                            send_test(port_fds[j]);
+                        }
+
+                        if (send_port_request(j, requests[j])) {
+                            miss_sample(j, "unable to send request");
+                            stale[j] = 1;
+                        }
+                    }
+                    break;
+                }
             }
-            continue;
         }
 
-        if (fds[1].revents & POLLOUT) {
-            if (!send_request(port_fd))
-                fds[1].events = POLLIN;
-        }
+        stats_account(&stats.loop_ns_total, &stats.loop_ns_max, start);
     }
+
+on_quit:
+
+    dump_stats();
+    dump_faults();
+
+    return 0;
 }
 
 
+static const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"json", no_argument, NULL, 'j'},
+    {"once", no_argument, NULL, 'o'},
+    {NULL, 0, NULL, 0}
+};
+
+
 int main(int argc, char** argv)
 {
     int opt;
     int sig_fd = -1;
-    int port_fd = -1;
+    int port_fds[MAX_FEEDS] = {-1, -1, -1, -1};
+    const char *requests[MAX_FEEDS] = {DEFAULT_REQUEST, DEFAULT_REQUEST, DEFAULT_REQUEST, DEFAULT_REQUEST};
     int timer_fd = -1;
     int exit_code = EXIT_FAILURE;
     int debug_mode = 0;
-    const char *port = "/dev/ttyS0";
+    int lock_mode = 0;
+    int priority = 0;
+    const char *ports[MAX_FEEDS] = {"/dev/ttyS0"};
+    unsigned int ports_count = 0;
+    const char *rules = NULL;
     unsigned int delay = 10;
     unsigned int timeout = 5;
+    unsigned int slack = 0;
     const char *user_name = NULL;
-
-    while ((opt = getopt(argc, argv, "hdi:p:s:u:")) > 0)
+    const char *history = NULL;
+    const char *actions = NULL;
+    const char *alerts = NULL;
+    const char *probe_cache = NULL;
+    const char *socket_path = NULL;
+    const char *engine = "poll";
+    status_machine machine;
+    unsigned int window = 0;
+    float nominal = 230.0f;
+    const char *capture = NULL;
+    const char *replay = NULL;
+    int replay_fast = 0;
+    const char *state_path = NULL;
+    const char *battery = NULL;
+    int test_hour = -1;
+    int once = 0;
+    int json = 0;
+
+    while ((opt = getopt_long(argc, argv, "a:A:b:c:de:E:hFH:i:jmn:op:q:r:R:s:S:t:T:u:U:w:", long_options, NULL)) > 0)
         switch (opt) {
+            case 'a':
+                actions = optarg;
+                break;
+
+            case 'A':
+                probe_cache = optarg;
+                break;
+
+            case 'b':
+                battery = optarg;
+                break;
+
+            case 'c':
+                capture = optarg;
+                break;
+
             case 'd':
                 debug_mode = 1;
                 break;
 
+            case 'e':
+                alerts = optarg;
+                break;
+
+            case 'E':
+                engine = optarg;
+                break;
+
+            case 'F':
+                replay_fast = 1;
+                break;
+
+            case 'H':
+                history = optarg;
+                break;
+
             case 'i':
                 timeout = strtoul(optarg, NULL, 10);
                 if (timeout < 1 || timeout > 60) {
@@ -194,8 +338,48 @@ int main(int argc, char** argv)
                 }
                 break;
 
+            case 'j':
+                json = 1;
+                break;
+
+            case 'm':
+                lock_mode = 1;
+                break;
+
+            case 'n':
+                nominal = strtof(optarg, NULL);
+                if (nominal < 100.0f || nominal > 250.0f) {
+                    fprintf(stderr, "Error: Invalid nominal voltage value %s, must be in [100..250]\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'o':
+                once = 1;
+                break;
+
             case 'p':
-                port = optarg;
+                if (ports_count == MAX_FEEDS) {
+                    fprintf(stderr, "Error: Too many ports, up to %d are supported\n", MAX_FEEDS);
+                    return EXIT_FAILURE;
+                }
+                ports[ports_count++] = optarg;
+                break;
+
+            case 'q':
+                rules = optarg;
+                break;
+
+            case 'r':
+                priority = strtoul(optarg, NULL, 10);
+                if (priority < 1 || priority > 99) {
+                    fprintf(stderr, "Error: Invalid real-time priority value %d, must be in [1..99]\n", priority);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'R':
+                replay = optarg;
                 break;
 
             case 's':
@@ -206,56 +390,205 @@ int main(int argc, char** argv)
                 }
                 break;
 
+            case 'S':
+                slack = strtoul(optarg, NULL, 10);
+                if (slack > 1000 || (slack && 1000 % slack)) {
+                    fprintf(stderr, "Error: Invalid timer slack value %u, must be 0 or divide 1000\n", slack);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 't':
+                test_hour = strtol(optarg, NULL, 10);
+                if (test_hour < 0 || test_hour > 23) {
+                    fprintf(stderr, "Error: Invalid battery test hour value %d, must be in [0..23]\n", test_hour);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'T':
+                state_path = optarg;
+                break;
+
             case 'u':
                 user_name = optarg;
                 break;
 
+            case 'U':
+                socket_path = optarg;
+                break;
+
+            case 'w':
+                window = strtoul(optarg, NULL, 10);
+                if (window < 60 || window > 86400) {
+                    fprintf(stderr, "Error: Invalid line quality window value %u, must be in [60..86400]\n", window);
+                    return EXIT_FAILURE;
+                }
+                break;
+
             default:
                 printf(
-                    "Usage: fspupsmon [-h] [-d] [-i <SEC>] [-p <PORT>] [-s <MIN>] [-u <USER>]\n"
+                    "Usage: fspupsmon [-h] [-a <FILE>] [-A <DIR>] [-b <FILE>] [-c <FILE>] [-d] [-e <FILE>] [-E <ENGINE>] [-F] [-H <FILE>] [-i <SEC>] [-j] [-m] [-n <VOLTS>] [-o] [-p <PORT>]... [-q <RULES>] [-r <PRIO>] [-R <FILE>] [-s <MIN>] [-S <MS>] [-t <HOUR>] [-T <FILE>] [-u <USER>] [-U <PATH>] [-w <SEC>]\n"
                     "Arguments:\n"
-                    "    -h: show this help;\n"
+                    "    -h, --help: show this help;\n"
+                    "    -a <FILE>: run staged load-shedding actions from the file;\n"
+                    "    -A <DIR>: probe port speed and request, cache results in the directory;\n"
+                    "    -b <FILE>: track battery health, keep baselines and capacity estimates in the file;\n"
+                    "    -c <FILE>: capture all data read from and written to the port;\n"
                     "    -d: turn on debug mode;\n"
+                    "    -e <FILE>: deliver alerts to webhook, SMTP and spool sinks from the file;\n"
+                    "    -E <ENGINE>: event engine: poll, uring (falls back to poll if unavailable) (default poll);\n"
+                    "    -F: replay the capture as fast as possible;\n"
+                    "    -H <FILE>: record samples and rollups to the history file;\n"
                     "    -i <SEC>: query interval, seconds (default %u)\n"
-                    "    -p <PORT>: serial port (default %s);\n"
+                    "    -j, --json: print the status as JSON line in one-shot mode;\n"
+                    "    -m: lock memory and make the event loop allocation free;\n"
+                    "    -n <VOLTS>: nominal input voltage for sag/surge detection (default %.0f);\n"
+                    "    -o, --once: print the current UPS status and exit with status-based code;\n"
+                    "    -p <PORT>: serial port, repeat for redundant feeds (default %s);\n"
+                    "    -q <RULES>: shutdown rules for redundant feeds: any, all, any-low (default any);\n"
+                    "    -r <PRIO>: run the event loop with real-time priority [1..99];\n"
+                    "    -R <FILE>: replay the capture through the parser and the status machine and exit;\n"
                     "    -s <MIN>: delay before shutdown, minutes (default %u)\n"
-                    "    -u <USER>: drop privileges to specified user;\n",
-                    timeout, port, delay
+                    "    -S <MS>: timer slack for coalescing wakeups, ticks are aligned to its multiples, milliseconds (default %u);\n"
+                    "    -t <HOUR>: run battery self-test of one UPS a day at the local hour, requires -b;\n"
+                    "    -T <FILE>: keep outage state in the file to survive restarts;\n"
+                    "    -u <USER>: drop privileges to specified user;\n"
+                    "    -U <PATH>: publish events to subscribers on the Unix socket;\n"
+                    "    -w <SEC>: collect input line quality statistics over windows of given length;\n",
+                    timeout, nominal, ports[0], delay, slack
                 );
                 return EXIT_FAILURE;
         }
 
+    if (!ports_count)
+        ports_count = 1;
+
+    if (test_hour >= 0 && battery == NULL) {
+        fprintf(stderr, "Error: Battery self-test requires battery health tracking\n");
+        return EXIT_FAILURE;
+    }
+
+    if (capture != NULL && ports_count > 1) {
+        fprintf(stderr, "Error: Capture of more than one port is not supported\n");
+        return EXIT_FAILURE;
+    }
+
     init_log(debug_mode);
 
-    if (user_name != NULL && init_privileges(user_name))
+    if (init_faults())
+        return EXIT_FAILURE;
+
+    if (replay != NULL) {
+        if (replay_fast && !debug_mode)
+            setlogmask(LOG_UPTO(LOG_WARNING));  /* do not let logging dominate the benchmark */
+        return replay_capture(replay, replay_fast, delay * 60) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (once) {
+        const int ret = query_once(ports[0], socket_path, probe_cache, json);
+        closelog();
+        return ret;
+    }
+
+    if (lock_mode && lock_memory())
+        goto on_error;
+
+    if (priority && set_realtime_priority(priority))
+        goto on_error;
+
+    if (actions != NULL && load_actions(actions))
+        goto on_error;
+
+    if (alerts != NULL && load_alerts(alerts))
+        goto on_error;
+
+    if (init_policy(rules, ports_count))
+        goto on_error;
+
+    if (init_privileges(user_name))
         goto on_error;
 
     sig_fd = register_quit_signals();
     if (sig_fd < 0)
         goto on_error;
 
-    port_fd = open_port(port);
-    if (port_fd < 0)
+    /* ports are locked first, so a second daemon on the same port leaves files of the first one alone */
+    for (unsigned int i = 0; i < ports_count; i++) {
+        port_fds[i] = open_port(ports[i]);
+        if (port_fds[i] < 0)
+            goto on_error;
+
+        if (probe_cache != NULL && probe_port(port_fds[i], ports[i], probe_cache, &(requests[i])))
+            goto on_error;
+    }
+
+    if (history != NULL && open_history(history))
+        goto on_error;
+
+    if (socket_path != NULL && open_subscribers(socket_path))
+        goto on_error;
+
+    if (capture != NULL && open_capture(capture))
         goto on_error;
 
-    timer_fd = create_timer(timeout);
+    timer_fd = create_timer(timeout, slack);
     if (timer_fd < 0)
         goto on_error;
 
-    process_events(sig_fd, port_fd, timer_fd, delay * 60);
-    exit_code = EXIT_SUCCESS;
+    if (open_engine(engine, sig_fd, timer_fd, port_fds, ports_count, timeout * 1000))
+        goto on_error;
+
+    init_status(&machine, &system_status_ops, delay * 60);
+
+    if (state_path != NULL && open_state(state_path, &machine, (uint64_t) timeout * 1000))
+        goto on_error;
+
+    if (battery != NULL && open_battery(battery, test_hour))
+        goto on_error;
+
+    if (window)
+        init_quality(window, nominal);
+
+    if (start_alerts())
+        goto on_error;
+
+    if (start_pipeline())
+        goto on_error;
+
+    mark_allocations();
+
+    if (!process_events(sig_fd, port_fds, requests, ports_count, &machine, debug_mode))
+        exit_code = EXIT_SUCCESS;
 
 on_error:
 
+    close_engine();
+
     if (timer_fd > 0 && close(timer_fd))
         LOG_E("unable to close timerfd #%d, error '%m'", timer_fd);
 
-    if (port_fd > 0 && close(port_fd))
-        LOG_E("unable to close port %s, error '%m'", port);
+    for (unsigned int i = 0; i < ports_count; i++)
+        if (port_fds[i] > 0 && close(port_fds[i]))
+            LOG_E("unable to close port %s, error '%m'", ports[i]);
 
     if (sig_fd > 0 && close(sig_fd))
         LOG_E("unable to close signalfd #%d, error '%m'", sig_fd);
 
+    stop_pipeline();
+
+    stop_alerts();
+
+    close_subscribers();
+
+    close_capture();
+
+    close_state();
+
+    close_battery();
+
+    close_history();
+
     free_privileges();
 
     LOG_I("shutdown completed");
@@ -0,0 +1,308 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "once.h"
+#include "port.h"
+#include "probe.h"
+#include "protocol.h"
+
+
+#define ONCE_TIMEOUT (2000)  /* max time to wait for the status, milliseconds */
+#define LINE_SIZE (512)
+
+
+static const char *status_names[] = {
+    "online",
+    "offline",
+    "invalid"
+};
+
+
+typedef struct {
+    const char *name;  /* JSON name */
+    const char *label;  /* text label */
+    const char *unit;
+    size_t offset;
+}
+once_value;
+
+
+static const once_value values[] = {
+    {"input_voltage", "input", "V", offsetof(ups_sample, input_voltage)},
+    {"fault_voltage", "fault", "V", offsetof(ups_sample, fault_voltage)},
+    {"output_voltage", "output", "V", offsetof(ups_sample, output_voltage)},
+    {"load", "load", "%", offsetof(ups_sample, load)},
+    {"frequency", "frequency", "Hz", offsetof(ups_sample, frequency)},
+    {"battery_voltage", "battery", "V", offsetof(ups_sample, battery_voltage)},
+    {"temperature", "temperature", "C", offsetof(ups_sample, temperature)}
+};
+#define VALUES_COUNT (sizeof(values) / sizeof(values[0]))
+
+
+static float* get_value(const ups_sample *sample, const size_t index)
+{
+    return (float*) ((const char*) sample + values[index].offset);
+}
+
+
+/*
+ * Find the field in the JSON line published by the daemon.
+ * Return pointer to the value or NULL if there is no such field.
+ */
+static const char* find_field(const char *line, const char *name)
+{
+    char key[32];
+
+    snprintf(key, sizeof(key), "\"%s\":", name);
+
+    const char *field = strstr(line, key);
+
+    return field != NULL ? field + strlen(key) : NULL;
+}
+
+
+/*
+ * Decode the state line published by the daemon.
+ * Return UPS status.
+ */
+static ups_status decode_line(const char *line, uint64_t *time, ups_sample *sample)
+{
+    const char *field;
+    ups_status status = INVALID_RESPONSE;
+
+    field = find_field(line, "status");
+    if (field != NULL)
+        for (size_t i = 0; i < sizeof(status_names) / sizeof(status_names[0]); i++) {
+            const size_t len = strlen(status_names[i]);
+
+            if (field[0] == '"' && !strncmp(field + 1, status_names[i], len) && field[len + 1] == '"')
+                status = i;
+        }
+
+    field = find_field(line, "time");
+    *time = field != NULL ? strtoull(field, NULL, 10) : 0;
+
+    for (size_t i = 0; i < VALUES_COUNT; i++) {
+        field = find_field(line, values[i].name);
+        *get_value(sample, i) = field != NULL && strncmp(field, "null", 4) ? strtof(field, NULL) : NAN;
+    }
+
+    field = find_field(line, "flags");
+    sample->flags = field != NULL ? strtoul(field + 1, NULL, 16) : 0;
+
+    return status;
+}
+
+
+/*
+ * Read the current state from the daemon.
+ * Return 0 on success and >0 if the daemon is not available.
+ */
+static int read_daemon(const char *socket_path, ups_status *status, uint64_t *time, ups_sample *sample)
+{
+    int ret = 1;
+    size_t size = 0;
+    char line[LINE_SIZE];
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        LOG_E("socket path '%s' is too long", socket_path);
+        return 1;
+    }
+
+    strcpy(addr.sun_path, socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_E("unable to create socket, error '%m'");
+        return 1;
+    }
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        LOG_D("daemon is not available on '%s', error '%m'", socket_path);
+        goto on_error;
+    }
+
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+
+    /* the first line is the current state */
+    while (size < sizeof(line) - 1 && memchr(line, '\n', size) == NULL) {
+        if (poll(&pfd, 1, ONCE_TIMEOUT) <= 0) {
+            LOG_E("daemon has not sent the state in time");
+            goto on_error;
+        }
+
+        const ssize_t count = read(fd, line + size, sizeof(line) - 1 - size);
+        if (count <= 0) {
+            LOG_E("unable to read the state from daemon, error '%m'");
+            goto on_error;
+        }
+
+        size += count;
+    }
+
+    line[size] = '\0';
+
+    *status = decode_line(line, time, sample);
+
+    ret = 0;
+
+on_error:
+
+    if (close(fd))
+        LOG_E("unable to close socket, error '%m'");
+
+    return ret;
+}
+
+
+/*
+ * Query the UPS on the port.
+ * Return UPS status.
+ */
+static ups_status query_port(const char *port, const char *probe_cache, uint64_t *time, ups_sample *sample)
+{
+    struct timespec tm;
+    ups_status status = INVALID_RESPONSE;
+    const char *request = DEFAULT_REQUEST;
+
+    const int fd = open_port(port);
+    if (fd < 0)
+        return INVALID_RESPONSE;
+
+    if (probe_cache != NULL && probe_port(fd, port, probe_cache, &request))
+        goto on_error;
+
+    if (send_request(fd, request))
+        goto on_error;
+
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+
+    if (poll(&pfd, 1, ONCE_TIMEOUT) <= 0 || !(pfd.revents & POLLIN)) {
+        LOG_E("UPS has not answered on port %s in time", port);
+        goto on_error;
+    }
+
+    status = parse_response(fd, sample);
+
+    if (!clock_gettime(CLOCK_REALTIME, &tm))
+        *time = (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+
+on_error:
+
+    if (close(fd))
+        LOG_E("unable to close port %s, error '%m'", port);
+
+    return status;
+}
+
+
+static void print_text(const ups_status status, const ups_sample *sample)
+{
+    printf("%s", status_names[status]);
+
+    if (status != INVALID_RESPONSE) {
+        for (size_t i = 0; i < VALUES_COUNT; i++) {
+            const float value = *get_value(sample, i);
+
+            if (!isnan(value))
+                printf(" %s=%.1f%s", values[i].label, value, values[i].unit);
+        }
+
+        printf(" flags=%02X", sample->flags);
+    }
+
+    printf("\n");
+}
+
+
+static void print_json(const ups_status status, const uint64_t time, const ups_sample *sample, const char *source)
+{
+    printf("{\"status\":\"%s\",\"time\":%" PRIu64 ",\"source\":\"%s\"", status_names[status], time, source);
+
+    if (status != INVALID_RESPONSE) {
+        for (size_t i = 0; i < VALUES_COUNT; i++) {
+            const float value = *get_value(sample, i);
+
+            if (isnan(value))
+                printf(",\"%s\":null", values[i].name);
+            else
+                printf(",\"%s\":%.1f", values[i].name, value);
+        }
+
+        printf(",\"flags\":\"%02X\"", sample->flags);
+    }
+
+    printf("}\n");
+}
+
+
+int query_once(const char *port, const char *socket_path, const char *probe_cache, const int json)
+{
+    ups_sample sample;
+    ups_status status = INVALID_RESPONSE;
+    uint64_t time = 0;
+    const char *source = "daemon";
+
+    memset(&sample, 0, sizeof(sample));
+
+    if (socket_path == NULL || read_daemon(socket_path, &status, &time, &sample)) {
+        source = "port";
+        status = query_port(port, probe_cache, &time, &sample);
+    }
+
+    if (json)
+        print_json(status, time, &sample, source);
+    else
+        print_text(status, &sample);
+
+    switch (status) {
+        case UPS_ONLINE:
+            return ONCE_ONLINE;
+
+        case UPS_OFFLINE:
+            return sample.flags & UPS_FLAG_BATTERY_LOW ? ONCE_BATTERY_LOW : ONCE_OFFLINE;
+
+        default:
+            return ONCE_UNKNOWN;
+    }
+}
@@ -0,0 +1,42 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ONCE_H_
+#define ONCE_H_
+
+
+/*
+ * Exit codes of the one-shot query, the same as monitoring plugins use.
+ */
+#define ONCE_ONLINE (0)  /* UPS is online */
+#define ONCE_OFFLINE (1)  /* UPS is on battery */
+#define ONCE_BATTERY_LOW (2)  /* UPS is on battery and the battery is low */
+#define ONCE_UNKNOWN (3)  /* no valid response */
+
+
+/*
+ * Get the current UPS status from the daemon listening on `socket_path' (NULL if none)
+ * or, if the daemon is not running, query the UPS on the port directly.
+ * The status is printed to stdout as text or as JSON line.
+ * Return the exit code (see above).
+ */
+int query_once(const char *port, const char *socket_path, const char *probe_cache, const int json);
+
+
+#endif /* ONCE_H_ */
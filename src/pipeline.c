@@ -0,0 +1,273 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "alerts.h"
+#include "battery.h"
+#include "history.h"
+#include "log.h"
+#include "pipeline.h"
+#include "quality.h"
+#include "realtime.h"
+#include "stats.h"
+#include "subscribers.h"
+#include "timer.h"
+
+
+#define QUEUE_SIZE (64)  /* must be a power of 2 */
+
+
+typedef enum {
+    ITEM_SAMPLE,
+    ITEM_POLICY,
+    ITEM_DUMP
+}
+item_type;
+
+
+typedef struct {
+    item_type type;
+    unsigned int feed;
+    uint64_t time;  /* time since boot the sample has been taken, ms */
+    ups_status status;
+    ups_sample sample;  /* valid if status is not INVALID_RESPONSE */
+    policy_result policy;  /* ITEM_POLICY only */
+}
+pipeline_item;
+
+
+static pipeline_item queue[QUEUE_SIZE];
+static atomic_uint queue_head;  /* next item to pop, written by the consumer */
+static atomic_uint queue_tail;  /* next item to push, written by the producer */
+static atomic_int stopping;
+
+static int event_fd = -1;  /* wakes the export thread up */
+static pthread_t thread;
+static int started = 0;
+
+
+/*
+ * Push the item to the queue and wake the consumer up.
+ * Return 0 on success and >0 if the queue is full.
+ */
+static int push_item(const pipeline_item *item)
+{
+    const unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+    const unsigned int head = atomic_load_explicit(&queue_head, memory_order_acquire);
+
+    if (tail - head == QUEUE_SIZE)
+        return 1;
+
+    queue[tail % QUEUE_SIZE] = *item;
+    atomic_store_explicit(&queue_tail, tail + 1, memory_order_release);
+
+    const uint64_t one = 1;
+
+    stats.syscalls++;
+    if (write(event_fd, &one, sizeof(one)) != sizeof(one))
+        LOG_E("unable to wake export thread up, error '%m'");
+
+    return 0;
+}
+
+
+/*
+ * Pop the item from the queue.
+ * Return 0 on success and >0 if the queue is empty.
+ */
+static int pop_item(pipeline_item *item)
+{
+    const unsigned int head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    const unsigned int tail = atomic_load_explicit(&queue_tail, memory_order_acquire);
+
+    if (head == tail)
+        return 1;
+
+    *item = queue[head % QUEUE_SIZE];
+    atomic_store_explicit(&queue_head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+
+static void process_item(const pipeline_item *item)
+{
+    battery_result battery;
+    quality_result quality;
+    const ups_sample *sample = item->status != INVALID_RESPONSE ? &(item->sample) : NULL;
+
+    switch (item->type) {
+        case ITEM_SAMPLE:
+            if (sample != NULL && !item->feed) {  /* history and line quality are of the first feed */
+                write_history(sample);
+                if (update_quality(item->status, sample, item->time, &quality))
+                    publish_quality(&quality);
+            }
+            publish_sample(item->feed, item->status, sample);
+            publish_alert(item->feed, item->status, sample);
+            if (update_battery(item->feed, item->status, sample, item->time, &battery))
+                publish_battery(&battery);
+            break;
+
+        case ITEM_POLICY:
+            publish_policy(&(item->policy));
+            break;
+
+        case ITEM_DUMP:
+            dump_quality();
+            dump_battery();
+            break;
+    }
+}
+
+
+static void* run_exporter(void *arg)
+{
+    uint64_t unused = 0;
+    pipeline_item item;
+    struct pollfd fds[1 + SUBSCRIBERS_POLLFDS];
+
+    (void) arg;
+
+    fds[0].fd = event_fd;
+    fds[0].events = POLLIN;
+
+    for (;;) {
+        fds[0].revents = 0;
+
+        const int subscribers_count = get_subscribers_pollfds(fds + 1);
+
+        if (poll(fds, 1 + subscribers_count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_E("poll() in export thread return error '%m'");
+            break;
+        }
+
+        if (process_subscribers(fds + 1, subscribers_count))
+            atomic_fetch_add_explicit(&stats.client_wakes, 1, memory_order_relaxed);
+
+        if (fds[0].revents & POLLIN)
+            read(event_fd, &unused, sizeof(unused));  /* we don't care about this data */
+
+        while (!pop_item(&item))
+            process_item(&item);
+
+        if (atomic_load(&stopping))
+            break;
+    }
+
+    return NULL;
+}
+
+
+int start_pipeline(void)
+{
+    atomic_init(&queue_head, 0);
+    atomic_init(&queue_tail, 0);
+    atomic_init(&stopping, 0);
+
+    event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+        LOG_E("unable to create eventfd, error '%m'");
+        return 1;
+    }
+
+    if (start_background_thread(&thread, "export", run_exporter)) {
+        close(event_fd);
+        event_fd = -1;
+        return 1;
+    }
+
+    started = 1;
+
+    return 0;
+}
+
+
+void push_sample(const unsigned int feed, const ups_status status, const ups_sample *sample)
+{
+    pipeline_item item = {
+        .type = ITEM_SAMPLE,
+        .feed = feed,
+        .time = get_boot_time_ms(),
+        .status = status
+    };
+
+    if (sample != NULL)
+        item.sample = *sample;
+
+    if (push_item(&item))
+        stats.dropped_samples++;
+}
+
+
+void push_policy(const policy_result *policy)
+{
+    pipeline_item item = {
+        .type = ITEM_POLICY,
+        .policy = *policy
+    };
+
+    item.policy.sample = NULL;  /* belongs to the event loop thread */
+
+    if (push_item(&item))
+        stats.dropped_samples++;
+}
+
+
+void push_dump(void)
+{
+    const pipeline_item item = {
+        .type = ITEM_DUMP
+    };
+
+    push_item(&item);
+}
+
+
+void stop_pipeline(void)
+{
+    const uint64_t one = 1;
+
+    if (!started)
+        return;
+
+    atomic_store(&stopping, 1);
+
+    if (write(event_fd, &one, sizeof(one)) != sizeof(one))
+        LOG_E("unable to wake export thread up, error '%m'");
+
+    const int ret = pthread_join(thread, NULL);
+    if (ret)
+        LOG_E("unable to join export thread, error '%s'", strerror(ret));
+
+    if (close(event_fd))
+        LOG_E("unable to close eventfd #%d, error '%m'", event_fd);
+
+    event_fd = -1;
+    started = 0;
+}
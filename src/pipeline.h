@@ -0,0 +1,63 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "policy.h"
+#include "protocol.h"
+
+
+/*
+ * The event loop thread owns the port, the timer and the shutdown decision.
+ * Samples are passed through a lock-free single producer single consumer
+ * queue to the export thread, which writes history, updates line quality
+ * statistics, serves subscribers and queues alerts, so slow consumers never
+ * delay polling.
+ */
+
+/*
+ * Start the export thread, all signals must be blocked already.
+ * Return 0 on success and >0 on error.
+ */
+int start_pipeline(void);
+
+/*
+ * Queue the sample (NULL if the response is invalid) of the feed for the export thread.
+ * The sample is dropped and counted if the queue is full.
+ */
+void push_sample(const unsigned int feed, const ups_status status, const ups_sample *sample);
+
+/*
+ * Queue the changed shutdown rules evaluation for the export thread.
+ */
+void push_policy(const policy_result *policy);
+
+/*
+ * Ask the export thread to write its statistics to the log.
+ */
+void push_dump(void);
+
+/*
+ * Process queued samples and stop the export thread.
+ */
+void stop_pipeline(void);
+
+
+#endif /* PIPELINE_H_ */
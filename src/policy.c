@@ -0,0 +1,236 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "log.h"
+#include "policy.h"
+#include "probes.h"
+
+
+#define RULES_SIZE (64)
+#define LOST_SAMPLES (3)  /* the feed is lost after this amount of invalid or missed samples in a row */
+
+
+typedef enum {
+    RULE_ANY = 1 << 0,
+    RULE_ALL = 1 << 1,
+    RULE_ANY_LOW = 1 << 2
+}
+policy_rule;
+
+
+typedef struct {
+    int known;  /* the feed has answered at least once */
+    unsigned int failures;  /* invalid or missed samples since the last valid one */
+    int lost;  /* the feed has not answered for LOST_SAMPLES samples or at all */
+    int on_battery;
+    int low;
+    ups_sample sample;  /* the last valid sample */
+}
+feed_state;
+
+
+static feed_state feeds[MAX_FEEDS];
+static unsigned int feeds_count = 1;
+static unsigned int rules_mask = RULE_ANY;
+static char rules_text[RULES_SIZE] = "any";
+
+/* updated incrementally on every sample */
+static unsigned int on_battery_count = 0;
+static unsigned int low_count = 0;
+static unsigned int lost_count = 0;  /* lost feeds which are not on battery by the last known state */
+static int rules_met = 0;
+
+
+int init_policy(const char *rules, const unsigned int feeds_amount)
+{
+    char buf[RULES_SIZE];
+    char *saveptr = NULL;
+
+    memset(feeds, 0, sizeof(feeds));
+    feeds_count = feeds_amount;
+    on_battery_count = 0;
+    low_count = 0;
+    lost_count = 0;
+    rules_met = 0;
+
+    if (rules == NULL)
+        rules = "any";
+
+    if (strlen(rules) >= sizeof(buf)) {
+        LOG_E("shutdown rules '%s' are too long", rules);
+        return 1;
+    }
+
+    strcpy(buf, rules);
+    strcpy(rules_text, rules);
+    rules_mask = 0;
+
+    for (char *rule = strtok_r(buf, ",", &saveptr); rule != NULL; rule = strtok_r(NULL, ",", &saveptr)) {
+        if (!strcmp(rule, "any"))
+            rules_mask |= RULE_ANY;
+        else if (!strcmp(rule, "all"))
+            rules_mask |= RULE_ALL;
+        else if (!strcmp(rule, "any-low"))
+            rules_mask |= RULE_ANY_LOW;
+        else {
+            LOG_E("unknown shutdown rule '%s'", rule);
+            return 1;
+        }
+    }
+
+    if (!rules_mask) {
+        LOG_E("no shutdown rules given");
+        return 1;
+    }
+
+    LOG_D("%u feeds, shutdown rules '%s'", feeds_count, rules_text);
+
+    return 0;
+}
+
+
+/*
+ * Evaluate the rules by counters, lost feeds are counted as lost capacity.
+ */
+static int evaluate(void)
+{
+    return ((rules_mask & RULE_ANY) && on_battery_count)
+           || ((rules_mask & RULE_ALL) && on_battery_count && on_battery_count + lost_count == feeds_count)
+           || ((rules_mask & RULE_ANY_LOW) && low_count);
+}
+
+
+/*
+ * Find the feed on battery with the lowest battery voltage.
+ * Return its sample or NULL if there are no feeds on battery.
+ */
+static const ups_sample* get_discharged_sample(void)
+{
+    const ups_sample *found = NULL;
+
+    for (unsigned int i = 0; i < feeds_count; i++) {
+        const feed_state *feed = &(feeds[i]);
+
+        if (!feed->on_battery)
+            continue;
+
+        if (found == NULL || isnan(found->battery_voltage)
+                || feed->sample.battery_voltage < found->battery_voltage)
+            found = &(feed->sample);
+    }
+
+    return found;
+}
+
+
+void update_policy(const unsigned int feed_index, const ups_status status, const ups_sample *sample,
+                   policy_result *result)
+{
+    feed_state *feed = &(feeds[feed_index]);
+    const int was_lost = feed->lost && !feed->on_battery;
+
+    if (status != INVALID_RESPONSE) {
+        const int on_battery = status == UPS_OFFLINE;
+        const int low = on_battery && (sample->flags & UPS_FLAG_BATTERY_LOW);
+
+        on_battery_count += on_battery - feed->on_battery;
+        low_count += low - feed->low;
+
+        feed->known = 1;
+        feed->failures = 0;
+        feed->lost = 0;
+        feed->on_battery = on_battery;
+        feed->low = low;
+        feed->sample = *sample;
+    }
+    else if (++(feed->failures) >= LOST_SAMPLES && !feed->lost) {
+        feed->lost = 1;
+        LOG_E("UPS #%u %s, its capacity is counted as lost", feed_index,
+              feed->known ? "does not answer" : "has never answered");
+    }
+
+    lost_count += (feed->lost && !feed->on_battery) - was_lost;
+
+    const int met = evaluate();
+
+    result->changed = met != rules_met;
+    rules_met = met;
+
+    result->feeds = feeds_count;
+    result->on_battery = on_battery_count;
+    result->low = low_count;
+    result->lost = lost_count;
+    result->met = met;
+
+    if (status == INVALID_RESPONSE) {
+        result->status = INVALID_RESPONSE;
+        result->sample = NULL;
+    }
+    else if (met) {
+        result->status = UPS_OFFLINE;
+        result->sample = get_discharged_sample();  /* every rule needs a feed on battery */
+    }
+    else {
+        result->status = UPS_ONLINE;
+        result->sample = sample;
+    }
+
+    if (result->changed) {
+        PROBE3(policy, on_battery_count, low_count, met);
+        if (feeds_count > 1)
+            LOG_I("%u of %u feeds on battery, %u with low battery, %u lost, shutdown rules '%s' are %s",
+                  on_battery_count, feeds_count, low_count, lost_count, rules_text, met ? "met" : "not met");
+        else
+            LOG_D("shutdown rules '%s' are %s", rules_text, met ? "met" : "not met");
+    }
+}
+
+
+int all_feeds_online(void)
+{
+    for (unsigned int i = 0; i < feeds_count; i++)
+        if (!feeds[i].known)
+            return 0;
+
+    return !on_battery_count;
+}
+
+
+unsigned int get_feeds_count(void)
+{
+    return feeds_count;
+}
+
+
+void dump_policy(void)
+{
+    for (unsigned int i = 0; i < feeds_count; i++) {
+        const feed_state *feed = &(feeds[i]);
+
+        LOG_I("policy: feed %u is %s%s", i, !feed->known ? "unknown" :
+              feed->low ? "on battery with low battery" : feed->on_battery ? "on battery" : "online",
+              feed->lost ? ", lost" : "");
+    }
+
+    LOG_I("policy: %u of %u feeds on battery, %u with low battery, %u lost, shutdown rules '%s' are %s",
+          on_battery_count, feeds_count, low_count, lost_count, rules_text, rules_met ? "met" : "not met");
+}
@@ -0,0 +1,79 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef POLICY_H_
+#define POLICY_H_
+
+#include "protocol.h"
+
+
+#define MAX_FEEDS (4)  /* max amount of UPSs feeding the system */
+
+
+/*
+ * Result of the rules evaluation for the status machine.
+ */
+typedef struct {
+    ups_status status;  /* offline while the rules are met, invalid if the sample is invalid */
+    const ups_sample *sample;  /* sample of the most discharged feed on battery or the last sample */
+    unsigned int feeds;  /* amount of feeds */
+    unsigned int on_battery;  /* amount of feeds on battery */
+    unsigned int low;  /* amount of feeds on battery with low battery */
+    unsigned int lost;  /* amount of lost feeds which are not on battery */
+    int met;  /* the rules are met */
+    int changed;  /* the evaluation has changed with the last sample */
+}
+policy_result;
+
+
+/*
+ * Set the amount of feeds and parse comma separated shutdown rules,
+ * the shutdown countdown runs while any of rules is met:
+ *      any - any feed is on battery (default);
+ *      all - all feeds are on battery or lost, at least one is on battery;
+ *      any-low - any feed is on battery and its battery is low;
+ * Return 0 on success and >0 on error.
+ */
+int init_policy(const char *rules, const unsigned int feeds);
+
+/*
+ * Update state of the feed with its sample (NULL if the response is invalid)
+ * and evaluate the rules. Invalid responses keep the last known state of the feed,
+ * feeds which have not answered for several samples in a row or at all are lost.
+ */
+void update_policy(const unsigned int feed, const ups_status status, const ups_sample *sample,
+                   policy_result *result);
+
+/*
+ * Return 1 if all feeds have answered and none of them is on battery, 0 otherwise.
+ */
+int all_feeds_online(void);
+
+/*
+ * Return the amount of feeds.
+ */
+unsigned int get_feeds_count(void);
+
+/*
+ * Write state of feeds and the rules evaluation to the log.
+ */
+void dump_policy(void);
+
+
+#endif /* POLICY_H_ */
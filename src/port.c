@@ -17,15 +17,43 @@
     along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 
 #include "log.h"
+#include "port.h"
 
 
-#define PORT_SPEED (B2400)  /* port speed according to Megatec protocol specification */
+int set_port_speed(const int fd, const speed_t speed)
+{
+    struct termios opts;
+
+    if (tcgetattr(fd, &opts)) {
+        LOG_E("unable to get settings from port #%d, error '%m'", fd);
+        return 1;
+    }
+
+    if (cfsetispeed(&opts, speed) || cfsetospeed(&opts, speed)) {
+        LOG_E("unable to set speed on port #%d", fd);
+        return 1;
+    }
+
+    if (tcsetattr(fd, TCSANOW, &opts) < 0) {
+        LOG_E("unable to apply setting to port #%d, error '%m'", fd);
+        return 1;
+    }
+
+    if (tcflush(fd, TCIOFLUSH) < 0) {
+        LOG_E("unable to flush port #%d, error '%m'", fd);
+        return 1;
+    }
+
+    return 0;
+}
 
 
 int open_port(const char* port)
@@ -39,6 +67,15 @@ int open_port(const char* port)
         return -1;
     }
 
+    /* the lock is taken before flushing, so the port of the running daemon is not disturbed */
+    if (flock(fd, LOCK_EX | LOCK_NB)) {
+        if (errno == EWOULDBLOCK)
+            LOG_E("port %s is used by another process, e.g. the daemon", port);
+        else
+            LOG_E("unable to lock port %s, error '%m'", port);
+        goto on_error;
+    }
+
     if (tcflush(fd, TCIOFLUSH) < 0) {
         LOG_E("unable to flush port %s, error '%m'", port);
         goto on_error;
@@ -77,15 +114,19 @@ int open_port(const char* port)
     }
 
     if (ioctl(fd, TIOCMGET, &mcs) < 0) {
-        LOG_E("ioctl(TIOCMGET), error '%m'");
-        goto on_error;
+        if (errno != ENOTTY && errno != EINVAL) {
+            LOG_E("ioctl(TIOCMGET), error '%m'");
+            goto on_error;
+        }
+        LOG_D("port %s has no modem control lines", port);  /* e.g. a pseudo terminal */
     }
+    else {
+        mcs |= TIOCM_RTS;
 
-    mcs |= TIOCM_RTS;
-
-    if (ioctl(fd, TIOCMSET, &mcs) < 0) {
-        LOG_E("ioctl(TIOCMSET), error '%m'");
-        goto on_error;
+        if (ioctl(fd, TIOCMSET, &mcs) < 0) {
+            LOG_E("ioctl(TIOCMSET), error '%m'");
+            goto on_error;
+        }
     }
 
     if (tcgetattr(fd, &opts)) {
@@ -20,12 +20,23 @@
 #ifndef PORT_H_
 #define PORT_H_
 
+#include <termios.h>
+
+
+#define PORT_SPEED (B2400)  /* port speed according to Megatec protocol specification */
+
 
 /*
- * Open UPS serial port and configure it.
- * Return the descriptor on success and -1 on error.
+ * Open UPS serial port, lock it exclusively and configure it.
+ * Return the descriptor on success and -1 on error, e.g. if the port is used by another process.
  */
 int open_port(const char* port);
 
+/*
+ * Change speed of the opened port and flush it.
+ * Return 0 on success and >0 on error.
+ */
+int set_port_speed(const int fd, const speed_t speed);
+
 
 #endif /* PORT_H_ */
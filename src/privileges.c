@@ -19,227 +19,564 @@
 
 #include <grp.h>
 #include <pwd.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 
+#include "actions.h"
 #include "log.h"
 #include "privileges.h"
+#include "realtime.h"
+#include "timer.h"
+
+
+#define SHUTDOWN_COMMAND ("shutdown")
+#define DEFAULT_PATH ("/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin")
+#define HELPER_TIMEOUT (10 * 1000)  /* max time to wait for the helper reply, milliseconds */
+
+#define SHELL_PATH ("/bin/sh")
+
+#define MSG_SHUTDOWN ('S')  /* request to the helper to run `shutdown' */
+#define MSG_ACTION ('A')  /* request to the helper to run an action command */
+
+
+typedef struct {
+    uint32_t seq;  /* sequence number, copied to the reply */
+    char type;  /* MSG_SHUTDOWN or MSG_ACTION */
+    unsigned char index;  /* action index */
+    unsigned char revert;  /* run revert command of the action */
+}
+helper_request;
 
 
 typedef struct {
-    gid_t *groups;  /* list of users groups */
-    int groups_count;  /* amount of users groups */
-    uid_t ruid, euid, suid;  /* real, effective and saved user IDs */
-    gid_t rgid, egid, sgid;  /* real, effective and saved group IDs */
+    uint32_t seq;  /* sequence number of the request */
+    int ret;  /* result of the request */
 }
-privileges_t;
+helper_reply;
+
 
+static char shutdown_path[PATH_MAX];  /* resolved `shutdown' path */
+static char *shutdown_argv[] = {shutdown_path, NULL};
 
-static privileges_t *root_privileges = NULL;
-static privileges_t *user_privileges = NULL;
+static int helper_fd = -1;  /* socket connected to the root helper */
+static pid_t helper_pid = -1;  /* root helper process */
+static int helper_lost = 0;  /* the helper has died, privileged commands are impossible */
+static uint32_t last_seq = 0;  /* sequence number of the last request */
+static unsigned int running_actions = 0;  /* action commands started by this process and not reaped yet */
 
 
 /*
- * Create and fill new privileges structure.
- * Take user name or NULL if it's root's account.
- * Return pointer to a new privileges structure on success or NULL on error.
+ * Find `shutdown' in PATH and save its full path.
+ * Return 0 on success and >0 on error.
  */
-static privileges_t* get_privileges(const char* user_name)
+static int resolve_shutdown(void)
 {
-    int is_root = 0;
-    gid_t *groups = NULL;
-    int groups_count = 1;
-    privileges_t *priv = NULL;
+    const char *path = getenv("PATH");
+
+    if (path == NULL || !*path)
+        path = DEFAULT_PATH;
+
+    while (*path) {
+        const char *end = strchrnul(path, ':');
+        const int len = end - path;
+
+        if (len && snprintf(shutdown_path, sizeof(shutdown_path), "%.*s/%s", len, path, SHUTDOWN_COMMAND) < (int) sizeof(shutdown_path)
+                && !access(shutdown_path, X_OK)) {
+            LOG_D("command '%s' resolved to '%s'", SHUTDOWN_COMMAND, shutdown_path);
+            return 0;
+        }
 
-    if (user_name == NULL) {
-        is_root = 1;
-        user_name = "root";
+        path = *end ? end + 1 : end;
     }
 
-    struct passwd *pwd = getpwnam(user_name);
-    if (pwd == NULL) {
-        LOG_E("unable to get user name '%s', error '%m'", user_name);
-        return NULL;
+    LOG_E("unable to find command '%s' in PATH", SHUTDOWN_COMMAND);
+
+    return 1;
+}
+
+
+/*
+ * Block all signals in the helper, the monitor handles them
+ * and stops the helper by closing the socket.
+ */
+static void block_signals(void)
+{
+    sigset_t mask;
+
+    sigfillset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+
+/*
+ * Unblock all signals in a child process, the monitor blocks them.
+ */
+static void unblock_signals(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+
+/*
+ * Reap finished action commands and log failed ones.
+ */
+static void reap_commands(void)
+{
+    int status = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (running_actions)
+            running_actions--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            LOG_E("action command #%d failed, status 0x%X", pid, status);
     }
+}
 
-    groups = (gid_t*) calloc(groups_count, sizeof(gid_t));
-    if (groups == NULL) {
-        LOG_E("unable to allocate memory for groups, error '%m'");
-        return NULL;
+
+/*
+ * Start the action command with shell without waiting for its completion.
+ * Return 0 on success and >0 on error.
+ */
+static int spawn_action(const unsigned int index, const int revert)
+{
+    const char *command = get_action_command(index, revert);
+
+    reap_commands();
+
+    if (command == NULL) {
+        LOG_E("no command for action %u", index);
+        return 1;
     }
 
-    const gid_t gid = pwd->pw_gid;
+    const pid_t pid = fork();
+
+    if (pid < 0) {
+        LOG_E("unable to fork, error '%m'");
+        return 1;
+    }
+
+    if (!pid) {
+        unblock_signals();
+        reset_priority();
+        execl(SHELL_PATH, "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+
+    running_actions++;
+
+    LOG_D("action command '%s' started as #%d", command, pid);
+
+    return 0;
+}
+
 
-    if (getgrouplist(user_name, gid, groups, &groups_count) == -1) {
-        if (groups_count <= 0) {
-            LOG_E("invalid amount %d of user groups", groups_count);
-            goto on_error;
+/*
+ * Run `shutdown' and wait for its completion.
+ * Return exit code of the command or -1 on error.
+ */
+static int exec_shutdown(void)
+{
+    int status = 0;
+
+    const pid_t pid = fork();
+
+    if (pid < 0) {
+        LOG_E("unable to fork, error '%m'");
+        return -1;
+    }
+
+    if (!pid) {
+        unblock_signals();
+        reset_priority();
+        execv(shutdown_path, shutdown_argv);
+        _exit(127);
+    }
+
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) {
+            LOG_E("unable to wait for command '%s', error '%m'", shutdown_path);
+            return -1;
         }
 
-        free(groups);
-        LOG_D("reallocating memory for store %d groups", groups_count);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
 
-        groups = (gid_t*) calloc(groups_count, sizeof(gid_t));
-        if (groups == NULL) {
-            LOG_E("unable to allocate memory for groups, error '%m'");
-            goto on_error;
+/*
+ * Root helper main loop: wait for requests from the monitor and serve them.
+ * Exit when the monitor closes its end of the socket.
+ */
+static void run_helper(const int fd)
+{
+    helper_request msg;
+    helper_reply reply;
+    sigset_t mask;
+
+    block_signals();
+    reset_priority();
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        LOG_E("unable to lock helper memory, error '%m'");
+
+    /* action commands are reaped as soon as they exit, not on the next request */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    struct pollfd fds[2] = {
+        {.fd = fd, .events = POLLIN},
+        {.fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK), .events = POLLIN}
+    };
+
+    if (fds[1].fd < 0)
+        LOG_E("unable to create helper signalfd, error '%m'");
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_E("helper poll() return error '%m'");
+            break;
         }
 
-        if (getgrouplist(user_name, gid, groups, &groups_count) <= 0) {
-            LOG_E("unable to get groups for user '%s'", user_name);
-            goto on_error;
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo sig_info;
+
+            while (read(fds[1].fd, &sig_info, sizeof(sig_info)) == sizeof(sig_info))
+                ;  /* SIGCHLD of several children may be merged, all of them are reaped */
+            reap_commands();
         }
+
+        if (!fds[0].revents)
+            continue;
+
+        const ssize_t size = recv(fd, &msg, sizeof(msg), 0);
+
+        if (size < 0 && errno == EINTR)
+            continue;
+
+        if (size <= 0)
+            break;
+
+        reply.seq = size == sizeof(msg) ? msg.seq : 0;
+        reply.ret = -1;
+
+        if (size != sizeof(msg))
+            LOG_E("helper got truncated request");
+        else if (msg.type == MSG_SHUTDOWN)
+            reply.ret = exec_shutdown();
+        else if (msg.type == MSG_ACTION)
+            reply.ret = spawn_action(msg.index, msg.revert);
+        else
+            LOG_E("helper got unknown request 0x%.2X", msg.type);
+
+        if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+            break;
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Drop all privileges to the user permanently.
+ * Return 0 on success and >0 on error.
+ */
+static int drop_privileges(const char *user_name)
+{
+    int groups_count = 0;
+
+    struct passwd *pwd = getpwnam(user_name);
+    if (pwd == NULL) {
+        LOG_E("unable to get user name '%s', error '%m'", user_name);
+        return 1;
     }
 
+    const uid_t uid = pwd->pw_uid;
+    const gid_t gid = pwd->pw_gid;
+
+    getgrouplist(user_name, gid, NULL, &groups_count);
     if (groups_count <= 0) {
         LOG_E("invalid amount %d of user groups", groups_count);
-        goto on_error;
+        return 1;
     }
 
-    priv = (privileges_t*) calloc(1, sizeof(privileges_t));
-    if (priv == NULL) {
-        LOG_E("unable to allocate memory for privileges, error '%m'");
-        goto on_error;
+    gid_t *groups = (gid_t*) calloc(groups_count, sizeof(gid_t));
+    if (groups == NULL) {
+        LOG_E("unable to allocate memory for groups, error '%m'");
+        return 1;
     }
 
-    if (is_root) {
-        if (getresuid(&(priv->ruid), &(priv->euid), &(priv->suid)) < 0) {
-            LOG_E("unable to get resuids, error '%m'");
-            goto on_error;
-        }
+    int ret = 1;
 
-        if (getresgid(&(priv->rgid), &(priv->egid), &(priv->sgid)) < 0) {
-            LOG_E("unable to get resgids, error '%m'");
-            goto on_error;
-        }
+    if (getgrouplist(user_name, gid, groups, &groups_count) <= 0) {
+        LOG_E("unable to get groups for user '%s'", user_name);
+        goto on_exit;
     }
-    else {
-        priv->ruid = priv->euid = priv->suid = pwd->pw_uid;
-        priv->rgid = priv->egid = priv->sgid = gid;
+
+    if (setgroups(groups_count, groups)) {
+        LOG_E("unable to set groups, error '%m'");
+        goto on_exit;
     }
 
-    priv->groups = groups;
-    priv->groups_count = groups_count;
+    if (setresgid(gid, gid, gid)) {
+        LOG_E("unable to set gid, error '%m'");
+        goto on_exit;
+    }
 
-    LOG_D("privileges initialized for user '%s'", user_name);
+    if (setresuid(uid, uid, uid)) {
+        LOG_E("unable to set uid, error '%m'");
+        goto on_exit;
+    }
 
-    return priv;
+    LOG_D("privileges dropped to user '%s'", user_name);
+    ret = 0;
 
-on_error:
+on_exit:
 
     free(groups);
 
-    free(priv);
-
-    return NULL;
+    return ret;
 }
 
 
 int init_privileges(const char *user_name)
 {
-    if (user_name == NULL) {
-        LOG_E("invalid user_name, null pointer");
+    int fds[2];
+
+    if (resolve_shutdown())
         return 1;
-    }
+
+    if (user_name == NULL)
+        return 0;
 
     if (getgid()) {
         LOG_E("unable to initialize privileges (you aint root)");
         return 1;
     }
 
-    if ((root_privileges = get_privileges(NULL)) == NULL)
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds)) {
+        LOG_E("unable to create helper socket, error '%m'");
         return 1;
+    }
+
+    helper_pid = fork();
+
+    if (helper_pid < 0) {
+        LOG_E("unable to fork helper, error '%m'");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+
+    if (!helper_pid) {
+        close(fds[0]);
+        run_helper(fds[1]);
+    }
 
-    if ((user_privileges = get_privileges(user_name)) == NULL)
-        goto on_error;
+    close(fds[1]);
+    helper_fd = fds[0];
 
-    if (set_user_privileges())
-        goto on_error;
+    LOG_D("root helper #%d started", helper_pid);
 
-    LOG_D("privileges initialized for user '%s'", user_name);
+    if (drop_privileges(user_name)) {
+        free_privileges();
+        return 1;
+    }
 
     return 0;
+}
+
+
+/*
+ * Reap the dead helper and close its socket, so the loss is logged when it happens.
+ */
+static void lose_helper(void)
+{
+    int status = 0;
 
-on_error:
+    if (helper_pid > 0 && waitpid(helper_pid, &status, WNOHANG) == helper_pid) {
+        LOG_E("root helper #%d died, status 0x%X, shutdown is impossible", helper_pid, status);
+        helper_pid = -1;
+    }
+    else
+        LOG_E("root helper #%d closed its socket, shutdown is impossible", helper_pid);
 
-    free_privileges();
+    if (close(helper_fd))
+        LOG_E("unable to close helper socket, error '%m'");
 
-    return 1;
+    helper_fd = -1;
+    helper_lost = 1;
 }
 
 
-int set_root_privileges(void)
+/*
+ * Read one reply from the helper.
+ * Return 0 on success and >0 on error.
+ */
+static int read_reply(helper_reply *reply)
 {
-    if (root_privileges == NULL) {
-        LOG_D("do not set root privileges because they have not been saved");
+    const ssize_t size = recv(helper_fd, reply, sizeof(*reply), MSG_DONTWAIT);
+
+    if (size == sizeof(*reply))
         return 0;
-    }
 
-    if (setresuid(root_privileges->ruid, root_privileges->euid, root_privileges->suid)) {
-        LOG_E("unable to set uid, error '%m'");
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
         return 1;
-    }
 
-    if (setresgid(root_privileges->rgid, root_privileges->egid, root_privileges->sgid)) {
-        LOG_E("unable to set gid, error '%m'");
-        return 1;
+    if (size < 0)
+        LOG_E("invalid reply from helper, error '%m'");
+    else if (size)
+        LOG_E("invalid reply from helper, %zd bytes", size);
+
+    lose_helper();
+
+    return 1;
+}
+
+
+/*
+ * Send the request to the helper and wait for the reply with the same sequence number,
+ * late replies to timed out requests are discarded.
+ * Return the reply or -1 on error.
+ */
+static int call_helper(helper_request *msg)
+{
+    helper_reply reply;
+
+    msg->seq = ++last_seq;
+
+    if (send(helper_fd, msg, sizeof(*msg), MSG_NOSIGNAL) != sizeof(*msg)) {
+        LOG_E("unable to send request to helper, error '%m'");
+        lose_helper();
+        return -1;
     }
 
-    if (setgroups(root_privileges->groups_count, root_privileges->groups)) {
-        LOG_E("unable to set groups, error '%m'");
-        return 1;
+    const uint64_t deadline = get_boot_time_ms() + HELPER_TIMEOUT;
+
+    for (;;) {
+        const uint64_t now = get_boot_time_ms();
+
+        if (now >= deadline) {
+            LOG_E("no reply from helper in %d ms", HELPER_TIMEOUT);
+            return -1;
+        }
+
+        struct pollfd pfd = {
+            .fd = helper_fd,
+            .events = POLLIN
+        };
+
+        const int ret = poll(&pfd, 1, deadline - now);
+
+        if (ret < 0 && errno != EINTR) {
+            LOG_E("unable to wait for helper reply, error '%m'");
+            return -1;
+        }
+
+        if (ret <= 0 || read_reply(&reply)) {
+            if (helper_fd < 0)
+                return -1;
+            continue;
+        }
+
+        if (reply.seq == msg->seq)
+            return reply.ret;
+
+        LOG_D("late reply %d to helper request #%u discarded", reply.ret, reply.seq);
     }
+}
 
-    LOG_D("privileges set to root");
 
-    return 0;
+int get_helper_fd(void)
+{
+    return helper_fd;
 }
 
 
-int set_user_privileges(void)
+void check_helper(const short revents)
 {
-    if (user_privileges == NULL) {
-        LOG_D("do not set user privileges because they have not been saved");
-        return 0;
-    }
+    helper_reply reply;
 
-    if (setgroups(user_privileges->groups_count, user_privileges->groups)) {
-        LOG_E("unable to set groups, error '%m'");
-        return 1;
-    }
+    if (helper_fd < 0)
+        return;
 
-    /* WARN: set suid/sgid to 0 to be able to restore root privileges  */
+    if (revents & POLLIN)
+        while (helper_fd >= 0 && !read_reply(&reply))
+            LOG_D("late reply %d to helper request #%u discarded", reply.ret, reply.seq);
 
-    if (setresgid(user_privileges->rgid, user_privileges->egid, 0)) {
-        LOG_E("unable to set gid, error '%m'");
-        return 1;
-    }
+    if (helper_fd >= 0 && (revents & (POLLERR | POLLHUP | POLLNVAL)))
+        lose_helper();
+}
 
-    if (setresuid(user_privileges->ruid, user_privileges->euid, 0)) {
-        LOG_E("unable to set uid, error '%m'");
+
+int run_shutdown(void)
+{
+    helper_request msg = {
+        .type = MSG_SHUTDOWN
+    };
+
+    if (helper_lost)
+        return -1;
+
+    if (helper_fd < 0)
+        return exec_shutdown();
+
+    return call_helper(&msg);
+}
+
+
+int run_action(const unsigned int index, const int revert)
+{
+    helper_request msg = {
+        .type = MSG_ACTION,
+        .index = index,
+        .revert = !!revert
+    };
+
+    if (helper_lost)
         return 1;
-    }
 
-    LOG_D("privileges set to user");
+    if (helper_fd < 0)
+        return spawn_action(index, revert);
 
-    return 0;
+    return call_helper(&msg) != 0;
+}
+
+
+void reap_actions(void)
+{
+    if (running_actions)
+        reap_commands();
 }
 
 
 void free_privileges(void)
 {
-    if (user_privileges != NULL) {
-        free(user_privileges->groups);
-        free(user_privileges);
-        user_privileges = NULL;
+    if (helper_fd >= 0) {
+        if (close(helper_fd))  /* helper exits on EOF */
+            LOG_E("unable to close helper socket, error '%m'");
+        helper_fd = -1;
     }
 
-    if (root_privileges != NULL) {
-        free(root_privileges->groups);
-        free(root_privileges);
-        root_privileges = NULL;
+    if (helper_pid > 0) {
+        if (waitpid(helper_pid, NULL, 0) < 0)
+            LOG_E("unable to wait for helper #%d, error '%m'", helper_pid);
+        helper_pid = -1;
     }
 }
@@ -22,25 +22,46 @@
 
 
 /*
- * Save root and user privileges.
+ * Resolve `shutdown' command and, if user name is given, start the root helper
+ * and drop all privileges of the current process to the user permanently.
+ * The helper has its memory locked and runs `shutdown' on request, so it does
+ * not depend on NSS or on swapped out pages when the time comes.
  * Return 0 on success and >0 on error.
  */
 int init_privileges(const char *user_name);
 
 /*
- * Restore root privileges.
- * Return 0 on success and >0 on error.
+ * Run `shutdown' via the helper (or directly if there is no helper).
+ * Return exit code of the command or -1 on error.
  */
-int set_root_privileges(void);
+int run_shutdown(void);
 
 /*
- * Restore user privileges back after last call of `set_root_privileges()'.
+ * Start the apply (or revert) command of the action via the helper
+ * (or directly if there is no helper) without waiting for its completion.
  * Return 0 on success and >0 on error.
  */
-int set_user_privileges(void);
+int run_action(const unsigned int index, const int revert);
+
+/*
+ * Return the helper socket to be polled by the event loop or -1 if there is no helper.
+ */
+int get_helper_fd(void);
+
+/*
+ * Handle events of the helper socket: discard late replies, reap the helper
+ * and log its loss if it has died.
+ */
+void check_helper(const short revents);
+
+/*
+ * Reap finished action commands started directly (without the helper).
+ * Does nothing when no such command is running.
+ */
+void reap_actions(void);
 
 /*
- * Free all allocated resources.
+ * Stop the helper and free all allocated resources.
  */
 void free_privileges(void);
 
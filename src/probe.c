@@ -0,0 +1,211 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <poll.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "port.h"
+#include "probe.h"
+#include "protocol.h"
+
+
+#define PROBE_TIMEOUT (300)  /* max time to wait for the first byte of a response, milliseconds */
+#define INFO_REQUEST ("I\r")
+
+
+typedef struct {
+    speed_t speed;
+    unsigned int baud;
+}
+probe_speed;
+
+
+static const probe_speed speeds[] = {
+    {B2400, 2400},
+    {B9600, 9600},
+    {B4800, 4800},
+    {B1200, 1200},
+    {B19200, 19200}
+};
+#define SPEEDS_COUNT (sizeof(speeds) / sizeof(speeds[0]))
+
+static const char *commands[] = {
+    "QS",
+    "Q1"
+};
+#define COMMANDS_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+
+/*
+ * Wait for the response with deadline.
+ * Return 0 if the response is available and >0 otherwise.
+ */
+static int wait_response(const int fd)
+{
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+
+    return poll(&pfd, 1, PROBE_TIMEOUT) <= 0 || !(pfd.revents & POLLIN);
+}
+
+
+/*
+ * Try the speed and the request.
+ * Return 0 if the UPS has answered with valid frame and >0 otherwise.
+ */
+static int try_config(const int fd, const size_t speed, const size_t command)
+{
+    ups_sample sample;
+
+    LOG_D("probing %u baud with request '%s'", speeds[speed].baud, commands[command]);
+
+    if (set_port_speed(fd, speeds[speed].speed) || send_request(fd, commands[command]))
+        return 1;
+
+    if (wait_response(fd))
+        return 1;
+
+    return parse_response(fd, &sample) == INVALID_RESPONSE;
+}
+
+
+/*
+ * Ask the UPS for its information and log it, the request is optional for UPSs.
+ */
+static void log_info(const int fd)
+{
+    char info[RESPONSE_SIZE];
+
+    memset(info, 0, sizeof(info));
+
+    if (write(fd, INFO_REQUEST, sizeof(INFO_REQUEST) - 1) != sizeof(INFO_REQUEST) - 1 || wait_response(fd))
+        return;
+
+    if (read(fd, info, sizeof(info) - 1) > 0 && info[0] == '#') {
+        info[strcspn(info, "\r")] = '\0';
+        LOG_I("UPS information '%s'", info + 1);
+    }
+}
+
+
+/*
+ * Build the cache file name for the port, slashes in the port path are replaced.
+ * Return 0 on success and >0 if the name is too long.
+ */
+static int get_cache_name(char *name, const size_t size, const char *port, const char *cache_dir)
+{
+    if (snprintf(name, size, "%s/%s", cache_dir, port) >= (int) size)
+        return 1;
+
+    for (char *c = name + strlen(cache_dir) + 1; *c; c++)
+        if (*c == '/')
+            *c = '_';
+
+    return 0;
+}
+
+
+/*
+ * Read cached configuration.
+ * Return 0 on success and >0 if there is no valid cache.
+ */
+static int read_cache(const char *name, size_t *speed, size_t *command)
+{
+    char request[8];
+    unsigned int baud = 0;
+    int ret = 1;
+
+    FILE *file = fopen(name, "re");
+    if (file == NULL)
+        return 1;
+
+    if (fscanf(file, "%u %7s", &baud, request) == 2)
+        for (size_t i = 0; i < SPEEDS_COUNT; i++)
+            for (size_t j = 0; j < COMMANDS_COUNT; j++)
+                if (speeds[i].baud == baud && !strcmp(commands[j], request)) {
+                    *speed = i;
+                    *command = j;
+                    ret = 0;
+                }
+
+    fclose(file);
+
+    return ret;
+}
+
+
+static void write_cache(const char *name, const size_t speed, const size_t command)
+{
+    FILE *file = fopen(name, "we");
+    if (file == NULL) {
+        LOG_E("unable to open probe cache '%s', error '%m'", name);
+        return;
+    }
+
+    fprintf(file, "%u %s\n", speeds[speed].baud, commands[command]);
+
+    if (fclose(file))
+        LOG_E("unable to write probe cache '%s', error '%m'", name);
+}
+
+
+int probe_port(const int fd, const char *port, const char *cache_dir, const char **request)
+{
+    char name[PATH_MAX];
+    size_t speed = 0;
+    size_t command = 0;
+
+    if (get_cache_name(name, sizeof(name), port, cache_dir)) {
+        LOG_E("probe cache name for port %s is too long", port);
+        return 1;
+    }
+
+    if (!read_cache(name, &speed, &command)) {
+        if (!try_config(fd, speed, command))
+            goto on_found;
+        LOG_I("cached configuration for port %s is not valid anymore, probing", port);
+    }
+
+    for (speed = 0; speed < SPEEDS_COUNT; speed++)
+        for (command = 0; command < COMMANDS_COUNT; command++)
+            if (!try_config(fd, speed, command)) {
+                write_cache(name, speed, command);
+                goto on_found;
+            }
+
+    LOG_E("UPS does not answer on port %s with any known configuration", port);
+
+    return 1;
+
+on_found:
+
+    LOG_I("port %s probed: %u baud, request '%s'", port, speeds[speed].baud, commands[command]);
+
+    log_info(fd);
+
+    *request = commands[command];
+
+    return set_port_speed(fd, speeds[speed].speed);  /* flush leftovers */
+}
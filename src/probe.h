@@ -0,0 +1,34 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBE_H_
+#define PROBE_H_
+
+
+/*
+ * Find speed and status request the UPS answers on the opened port.
+ * Cached result for the port is checked first, then all candidates are
+ * tried, the found configuration is saved to the cache directory.
+ * The status request for the port is returned in `request'.
+ * Return 0 if the port is configured and >0 on error.
+ */
+int probe_port(const int fd, const char *port, const char *cache_dir, const char **request);
+
+
+#endif /* PROBE_H_ */
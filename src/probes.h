@@ -0,0 +1,58 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBES_H_
+#define PROBES_H_
+
+
+/*
+ * USDT probes for bpftrace/perf, e.g.:
+ *      bpftrace -e 'usdt:/usr/bin/fspupsmon:fspupsmon:response { printf("%s\n", str(arg1)); }'
+ * Probes are compiled in when <sys/sdt.h> is available (systemtap-sdt-dev)
+ * and cost a single nop when nobody is tracing.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(fspupsmon, name)
+#define PROBE1(name, a1) DTRACE_PROBE1(fspupsmon, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(fspupsmon, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(fspupsmon, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(fspupsmon, name, a1, a2, a3, a4)
+
+#else
+
+#define PROBE0(name) do {} while (0)
+#define PROBE1(name, a1) do {} while (0)
+#define PROBE2(name, a1, a2) do {} while (0)
+#define PROBE3(name, a1, a2, a3) do {} while (0)
+#define PROBE4(name, a1, a2, a3, a4) do {} while (0)
+
+#endif
+
+
+#endif /* PROBES_H_ */
@@ -17,13 +17,17 @@
     along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <ctype.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "faults.h"
 #include "log.h"
+#include "probes.h"
 #include "protocol.h"
+#include "stats.h"
 
 
 /*
@@ -33,18 +37,41 @@
     - response:
         (229.2 229.2 229.2 014 50.1 27.6 --.- 00001001\r  // UPS online (high bit is NOT set)
         (012.3 229.7 220.2 014 50.1 24.6 --.- 10001001\r  // UPS offline (high bit is SET)
+    Some units answer the same way to the Megatec Q1 request instead.
 */
 
 
-#define REQUEST ("QS\r")
-#define STATUS_FMT ("%c[01][01][01][01][01][01][01]")
-#define REQUEST_SIZE (sizeof(REQUEST) - 1)
+#define STATUS_BITS (8)
+#define VALUES_FMT ("(%f %f %f %f %f %f %f")
+#define VALUES_COUNT (7)
 
 
-int send_request(const int fd)
+size_t format_request(char *request, const char *command)
 {
-    if (write(fd, REQUEST, REQUEST_SIZE) == REQUEST_SIZE) {
-        LOG_D("request has been sent");
+    snprintf(request, REQUEST_SIZE + 1, "%s\r", command);
+    return REQUEST_SIZE;
+}
+
+
+void request_written(const int fd, const char *request, const size_t size)
+{
+    (void) fd;  /* used by the probe only */
+
+    PROBE2(request, fd, request);
+    capture_data(CAPTURE_WRITE, request, size);
+    LOG_D("request has been sent");
+}
+
+
+int send_request(const int fd, const char *command)
+{
+    char request[REQUEST_SIZE + 1];
+    const size_t size = format_request(request, command);
+
+    stats.syscalls++;
+
+    if (PORT_WRITE(fd, request, size) == (ssize_t) size) {
+        request_written(fd, request, size);
         return 0;
     }
     else {
@@ -54,25 +81,105 @@ int send_request(const int fd)
 }
 
 
-ups_status parse_response(const int fd)
+int send_test(const int fd)
 {
-    char *delim;
-    char response[64];
+    static const char test[] = "T\r";
+
+    stats.syscalls++;
+
+    if (PORT_WRITE(fd, test, sizeof(test) - 1) == sizeof(test) - 1) {
+        capture_data(CAPTURE_WRITE, test, sizeof(test) - 1);
+        LOG_D("battery test request has been sent");
+        return 0;
+    }
+    else {
+        LOG_E("unable to send battery test request, error '%m'");
+        return 1;
+    }
+}
+
+
+/*
+ * Decode values preceding the status line, unparsed ones (like '--.-') are set to NAN.
+ */
+static void parse_values(const char *response, const char *status_line, ups_sample *sample)
+{
+    float *values[VALUES_COUNT] = {
+        &(sample->input_voltage),
+        &(sample->fault_voltage),
+        &(sample->output_voltage),
+        &(sample->load),
+        &(sample->frequency),
+        &(sample->battery_voltage),
+        &(sample->temperature)
+    };
+
+    const int count = sscanf(response, VALUES_FMT,
+                             values[0], values[1], values[2], values[3], values[4], values[5], values[6]);
+
+    for (int i = count < 0 ? 0 : count; i < VALUES_COUNT; i++)
+        *(values[i]) = NAN;
+
+    sample->flags = 0;
+
+    for (const char *bit = status_line; *bit == '0' || *bit == '1'; bit++)
+        sample->flags = (sample->flags << 1) | (*bit == '1');
+}
+
+
+ups_status parse_response(const int fd, ups_sample *sample)
+{
+    char response[RESPONSE_SIZE];
 
     memset(response, 0, sizeof(response));
 
-    ssize_t size = read(fd, response, sizeof(response) - 1);
+    stats.syscalls++;
+
+    const ssize_t size = PORT_READ(fd, response, sizeof(response) - 1);
+
+    return decode_response(fd, response, size, sample);
+}
+
+
+ups_status decode_response(const int fd, char *response, const ssize_t size, ups_sample *sample)
+{
+    (void) fd;  /* used by the probe only */
+
     if (size <= 0) {
         LOG_E("read() return %zd, error '%m'", size);
         return INVALID_RESPONSE;
     }
 
-    delim = strrchr(response, '\r');  /* terminate string with zero */
-    if (delim != NULL)
-        *delim = '\0';
+    capture_data(CAPTURE_READ, response, size);
+
+    const ups_status status = parse_frame(response, sample);
+
+    PROBE4(response, fd, response, status, status != INVALID_RESPONSE ? sample->flags : 0);
+
+    return status;
+}
+
+
+ups_status parse_frame(char *response, ups_sample *sample)
+{
+    char *delim;
+
+    /* truncated or split frames have no terminator */
+    delim = strchr(response, '\r');
+    if (delim == NULL) {
+        LOG_E("no terminator in response '%s', incomplete response", response);
+        return INVALID_RESPONSE;
+    }
+
+    *delim = '\0';  /* terminate string with zero */
 
     LOG_D("response='%s'", response);
 
+    if (response[0] != '(') {
+        LOG_E("no start mark in response, invalid response");
+        return INVALID_RESPONSE;
+    }
+
     delim = strrchr(response, ' ');  /* UPS status is after last space */
     if (delim == NULL) {
         LOG_E("unable to find last space in response, invalid response");
@@ -82,27 +189,12 @@ ups_status parse_response(const int fd)
     char *status_line = delim + 1;
     LOG_D("status='%s'", status_line);
 
-    char status = 0;
-
-    if (sscanf(status_line, STATUS_FMT, &status) != 1) {
-        LOG_E("invalid status line '%s', no matches found", status_line);
+    if (strspn(status_line, "01") != STATUS_BITS || status_line[STATUS_BITS]) {
+        LOG_E("invalid status line '%s', %d bits expected", status_line, STATUS_BITS);
         return INVALID_RESPONSE;
     }
 
-    switch (status) {
-        case '0':
-            return UPS_ONLINE;
-
-        case '1':
-            return UPS_OFFLINE;
-
-        default:
-            if (isprint(status))
-                LOG_E("invalid UPS status code '%c'", status);
-            else
-                LOG_E("invalid UPS status code 0x%.2X", status);
-            break;
-    }
+    parse_values(response, status_line, sample);
 
-    return INVALID_RESPONSE;
+    return status_line[0] == '1' ? UPS_OFFLINE : UPS_ONLINE;
 }
@@ -21,6 +21,9 @@
 #define PROTOCOL_H_
 
 
+#include <sys/types.h>
+
+
 typedef enum {
     UPS_ONLINE,
     UPS_OFFLINE,
@@ -30,16 +33,83 @@ ups_status;
 
 
 /*
- * Send the request to the UPS.
+ * Status bits from the last field of the response, b7 is the first character.
+ */
+#define UPS_FLAG_UTILITY_FAIL (1 << 7)
+#define UPS_FLAG_BATTERY_LOW (1 << 6)
+#define UPS_FLAG_BYPASS (1 << 5)
+#define UPS_FLAG_UPS_FAILED (1 << 4)
+#define UPS_FLAG_STANDBY (1 << 3)
+#define UPS_FLAG_TEST (1 << 2)
+#define UPS_FLAG_SHUTDOWN (1 << 1)
+#define UPS_FLAG_BEEPER (1 << 0)
+
+
+/*
+ * Values decoded from the response, absent values are set to NAN.
+ */
+typedef struct {
+    float input_voltage;  /* input voltage, V */
+    float fault_voltage;  /* input fault voltage, V */
+    float output_voltage;  /* output voltage, V */
+    float load;  /* output load, % */
+    float frequency;  /* input frequency, Hz */
+    float battery_voltage;  /* battery voltage, V */
+    float temperature;  /* temperature, C */
+    unsigned int flags;  /* status bits (see above) */
+}
+ups_sample;
+
+
+#define RESPONSE_SIZE (64)  /* max response size including terminating zero */
+
+
+#define DEFAULT_REQUEST ("QS")  /* the status request of FSP units, some answer to "Q1" only */
+
+#define REQUEST_SIZE (3)  /* request size without terminating zero */
+
+
+/*
+ * Format the status request for `command' to `request' of REQUEST_SIZE + 1 bytes.
+ * Return the size of the request to write.
+ */
+size_t format_request(char *request, const char *command);
+
+/*
+ * Account the request written to the port by the caller (probe, capture).
+ */
+void request_written(const int fd, const char *request, const size_t size);
+
+/*
+ * Send the status request "QS" or "Q1" to the UPS.
+ * Return 0 on success and >0 on error.
+ */
+int send_request(const int fd, const char *command);
+
+/*
+ * Send the 10 seconds battery test request "T" to the UPS, it has no response.
  * Return 0 on success and >0 on error.
  */
-int send_request(const int fd);
+int send_test(const int fd);
+
+/*
+ * Read and parse the reposponse from the UPS, store decoded values to `sample'.
+ * Return current UPS status (see above).
+ */
+ups_status parse_response(const int fd, ups_sample *sample);
+
+/*
+ * Parse the zero terminated `response' of `size' bytes read from the port by the caller,
+ * `size' <= 0 is a failed read with errno set.
+ * Return current UPS status (see above).
+ */
+ups_status decode_response(const int fd, char *response, const ssize_t size, ups_sample *sample);
 
 /*
- * Read and parse the reposponse from the UPS.
+ * Parse the zero terminated response (modified in place), store decoded values to `sample'.
  * Return current UPS status (see above).
  */
-ups_status parse_response(const int fd);
+ups_status parse_frame(char *response, ups_sample *sample);
 
 
 #endif /* PROTOCOL_H_ */
@@ -0,0 +1,264 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "quality.h"
+
+
+#define BINS_COUNT (300)  /* histogram size, fixed memory for quantiles */
+#define EWMA_ALPHA (0.1f)
+#define SAG_RATIO (0.9f)
+#define SURGE_RATIO (1.1f)
+#define DROPOUT_RATIO (0.5f)  /* the input is lost below it, e.g. the UPS has not reported the outage yet */
+
+
+typedef struct {
+    const char *name;
+    float bin_min, bin_width;  /* histogram range */
+    float ewma, min, max;
+    uint32_t count;
+    uint32_t bins[BINS_COUNT];
+}
+series_t;
+
+
+typedef struct {
+    const char *name;
+    int active;  /* the event is in progress */
+    uint64_t start;  /* time the event has started, milliseconds */
+    float extreme;  /* the lowest (sag) or the highest (surge) voltage */
+    uint32_t count;  /* amount of events in the window */
+    uint64_t longest;  /* the longest event in the window, milliseconds */
+}
+line_event;
+
+
+static series_t voltage = {.name = "input voltage", .bin_min = 0.0f, .bin_width = 1.0f};  /* 0..300 V */
+static series_t frequency = {.name = "input frequency", .bin_min = 40.0f, .bin_width = 0.1f};  /* 40..70 Hz */
+static line_event sag = {.name = "sag"};
+static line_event surge = {.name = "surge"};
+static float fault_min = NAN;  /* the lowest input fault voltage in the window */
+
+static int enabled = 0;
+static uint64_t window_ms = 0;
+static uint64_t window_start = 0;
+static float sag_level = 0.0f;
+static float surge_level = 0.0f;
+static float dropout_level = 0.0f;
+
+
+static void update_series(series_t *series, const float value)
+{
+    if (isnan(value))
+        return;
+
+    if (!series->count) {
+        series->min = series->max = value;
+        if (isnan(series->ewma))
+            series->ewma = value;
+    }
+
+    if (value < series->min)
+        series->min = value;
+    if (value > series->max)
+        series->max = value;
+
+    series->ewma += EWMA_ALPHA * (value - series->ewma);  /* EWMA is kept between windows */
+    series->count++;
+
+    int bin = (value - series->bin_min) / series->bin_width + 0.001f;  /* values are multiples of the width */
+    if (bin < 0)
+        bin = 0;
+    if (bin >= BINS_COUNT)
+        bin = BINS_COUNT - 1;
+    series->bins[bin]++;
+}
+
+
+/*
+ * Return the value of the quantile (0..1) from the histogram, the middle of the bin.
+ */
+static float get_quantile(const series_t *series, const float quantile)
+{
+    const uint32_t rank = ceilf(quantile * series->count);
+    uint32_t sum = 0;
+
+    for (int i = 0; i < BINS_COUNT; i++) {
+        sum += series->bins[i];
+        if (sum >= rank && sum)
+            return series->bin_min + (i + 0.5f) * series->bin_width;
+    }
+
+    return NAN;
+}
+
+
+static void get_series(const series_t *series, quality_series *result)
+{
+    result->samples = series->count;
+    result->ewma = series->ewma;
+
+    if (!series->count) {
+        result->min = result->max = result->p1 = result->p50 = result->p99 = NAN;
+        return;
+    }
+
+    result->min = series->min;
+    result->max = series->max;
+    result->p1 = get_quantile(series, 0.01f);
+    result->p50 = get_quantile(series, 0.5f);
+    result->p99 = get_quantile(series, 0.99f);
+}
+
+
+static void log_series(const series_t *series)
+{
+    quality_series result;
+
+    if (!series->count)
+        return;
+
+    get_series(series, &result);
+
+    LOG_I("line quality: %s ewma=%.1f min=%.1f max=%.1f p1=%.1f p50=%.1f p99=%.1f samples=%" PRIu32,
+          series->name, result.ewma, result.min, result.max, result.p1, result.p50, result.p99, result.samples);
+}
+
+
+static void reset_series(series_t *series)
+{
+    series->count = 0;
+    memset(series->bins, 0, sizeof(series->bins));
+}
+
+
+/*
+ * Track the event: start it when the condition is met, log and account it when it's over.
+ */
+static void update_event(line_event *event, const int condition, const float value, const uint64_t now)
+{
+    if (condition) {
+        if (!event->active) {
+            event->active = 1;
+            event->start = now;
+            event->extreme = value;
+            LOG_I("line quality: %s started, input voltage %.1f V", event->name, value);
+        }
+        else if ((event == &sag && value < event->extreme) || (event == &surge && value > event->extreme))
+            event->extreme = value;
+        return;
+    }
+
+    if (!event->active)
+        return;
+
+    const uint64_t duration = now - event->start;
+
+    event->active = 0;
+    event->count++;
+    if (duration > event->longest)
+        event->longest = duration;
+
+    LOG_I("line quality: %s ended after %" PRIu64 " ms, extreme input voltage %.1f V", event->name, duration, event->extreme);
+}
+
+
+void init_quality(const unsigned int window, const float nominal)
+{
+    enabled = 1;
+    window_ms = (uint64_t) window * 1000;
+    window_start = 0;
+    sag_level = nominal * SAG_RATIO;
+    surge_level = nominal * SURGE_RATIO;
+    dropout_level = nominal * DROPOUT_RATIO;
+    voltage.ewma = frequency.ewma = NAN;
+
+    LOG_D("line quality window %u sec, sag below %.1f V, surge above %.1f V, dropout below %.1f V",
+          window, sag_level, surge_level, dropout_level);
+}
+
+
+int update_quality(const ups_status status, const ups_sample *sample, const uint64_t time, quality_result *result)
+{
+    if (!enabled)
+        return 0;
+
+    if (!window_start)
+        window_start = time;
+
+    /* there is no line to measure during an outage, its ~0 V would count as the deepest sag */
+    const int outage = status == UPS_OFFLINE || (sample->flags & UPS_FLAG_UTILITY_FAIL) ||
+                       (!isnan(sample->input_voltage) && sample->input_voltage < dropout_level);
+
+    if (!isnan(sample->fault_voltage) && (isnan(fault_min) || sample->fault_voltage < fault_min))
+        fault_min = sample->fault_voltage;
+
+    if (outage) {
+        update_event(&sag, 0, sample->input_voltage, time);  /* a sag before the outage ends with it */
+        update_event(&surge, 0, sample->input_voltage, time);
+    }
+    else {
+        update_series(&voltage, sample->input_voltage);
+        update_series(&frequency, sample->frequency);
+
+        if (!isnan(sample->input_voltage)) {
+            update_event(&sag, sample->input_voltage < sag_level, sample->input_voltage, time);
+            update_event(&surge, sample->input_voltage > surge_level, sample->input_voltage, time);
+        }
+    }
+
+    if (time - window_start < window_ms)
+        return 0;
+
+    dump_quality();
+
+    get_series(&voltage, &(result->voltage));
+    get_series(&frequency, &(result->frequency));
+    result->sags = sag.count;
+    result->surges = surge.count;
+    result->longest_sag = sag.longest;
+    result->longest_surge = surge.longest;
+    result->fault_min = fault_min;
+
+    reset_series(&voltage);
+    reset_series(&frequency);
+    sag.count = sag.longest = 0;
+    surge.count = surge.longest = 0;
+    fault_min = NAN;
+    window_start = time;
+
+    return 1;
+}
+
+
+void dump_quality(void)
+{
+    if (!enabled)
+        return;
+
+    log_series(&voltage);
+    log_series(&frequency);
+
+    LOG_I("line quality: sags=%" PRIu32 " longest=%" PRIu64 " ms, surges=%" PRIu32 " longest=%" PRIu64 " ms, min fault voltage=%.1f",
+          sag.count, sag.longest, surge.count, surge.longest, fault_min);
+}
@@ -0,0 +1,73 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QUALITY_H_
+#define QUALITY_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+
+/*
+ * Summary of the series in the window.
+ */
+typedef struct {
+    float ewma, min, max;  /* EWMA is kept between windows */
+    float p1, p50, p99;  /* percentiles */
+    uint32_t samples;  /* amount of samples in the window, the values are NAN if there are no samples */
+}
+quality_series;
+
+
+/*
+ * Line quality statistics of the window.
+ */
+typedef struct {
+    quality_series voltage;  /* input voltage, V */
+    quality_series frequency;  /* input frequency, Hz */
+    uint32_t sags, surges;  /* amount of events ended in the window */
+    uint64_t longest_sag, longest_surge;  /* the longest events in the window, milliseconds */
+    float fault_min;  /* the lowest input fault voltage, NAN if unknown */
+}
+quality_result;
+
+
+/*
+ * Initialize input line statistics with the window length (seconds) and
+ * the nominal input voltage used to detect sags (below 90%), surges (above 110%) and outages (below 50%).
+ */
+void init_quality(const unsigned int window, const float nominal);
+
+/*
+ * Update streaming statistics with the sample taken at the given time since boot, ms,
+ * in O(1) and log sag/surge events when they end. Samples taken on battery or with the input
+ * below 50% of the nominal voltage are outages, they are not accounted as line values or sags.
+ * When the window is over the summary is logged and the next window is started.
+ * Return 1 if the window is over and the result is set, 0 otherwise.
+ */
+int update_quality(const ups_status status, const ups_sample *sample, const uint64_t time, quality_result *result);
+
+/*
+ * Write statistics of the current window to the log.
+ */
+void dump_quality(void);
+
+
+#endif /* QUALITY_H_ */
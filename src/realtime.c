@@ -0,0 +1,203 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "log.h"
+#include "realtime.h"
+#include "stats.h"
+
+
+#define STACK_PREFAULT_SIZE (64 * 1024)  /* stack size touched in advance */
+#define HIGHEST_NICE (-20)
+#define BACKGROUND_NICE (10)
+#define BACKGROUND_STACK_SIZE (256 * 1024)  /* locked in memory as a whole with -m */
+
+
+static size_t heap_in_use = 0;  /* heap memory in use after initialization */
+static int nice_raised = 0;  /* the highest nice value is set instead of real-time priority */
+
+
+typedef struct {
+    const char *name;
+    void* (*routine)(void*);
+    pthread_barrier_t barrier;  /* the thread is initialized before the event loop starts */
+}
+thread_start;
+
+
+/*
+ * Touch the stack pages to have them mapped before the event loop starts.
+ * Stores go through the volatile pointer one per page, so they are not optimized out.
+ */
+static void __attribute__((noinline)) prefault_stack(void)
+{
+    char stack[STACK_PREFAULT_SIZE];
+    volatile char *page = stack;
+    const long page_size = sysconf(_SC_PAGESIZE);
+
+    for (long i = 0; i < STACK_PREFAULT_SIZE; i += page_size > 0 ? page_size : 4096)
+        page[i] = 0;
+}
+
+
+int lock_memory(void)
+{
+    const struct rlimit limit = {
+        .rlim_cur = RLIM_INFINITY,
+        .rlim_max = RLIM_INFINITY
+    };
+
+    /* unprivileged user would be unable to lock future pages otherwise */
+    if (setrlimit(RLIMIT_MEMLOCK, &limit))
+        LOG_E("unable to raise memory lock limit, error '%m'");
+
+    if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+        LOG_E("unable to tune memory allocator");
+        return 1;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        LOG_E("unable to lock memory, error '%m'");
+        return 1;
+    }
+
+    prefault_stack();
+
+    LOG_D("memory locked");
+
+    return 0;
+}
+
+
+int set_realtime_priority(const int priority)
+{
+    const struct sched_param param = {
+        .sched_priority = priority
+    };
+
+    /* children (the root helper, actions, `shutdown') start with the default policy */
+    if (!sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param)) {
+        LOG_I("real-time priority %d set", priority);
+        return 0;
+    }
+
+    LOG_E("unable to set real-time priority %d, error '%m'", priority);
+
+    if (setpriority(PRIO_PROCESS, 0, HIGHEST_NICE)) {
+        LOG_E("unable to set nice value %d, error '%m'", HIGHEST_NICE);
+        return 1;
+    }
+
+    nice_raised = 1;
+
+    LOG_I("nice value %d set instead of real-time priority", HIGHEST_NICE);
+
+    return 0;
+}
+
+
+void reset_priority(void)
+{
+    if (nice_raised && setpriority(PRIO_PROCESS, 0, 0))
+        LOG_E("unable to reset nice value, error '%m'");
+}
+
+
+void mark_allocations(void)
+{
+    heap_in_use = mallinfo2().uordblks;
+    LOG_D("%zu bytes of heap in use after initialization", heap_in_use);
+}
+
+
+void check_allocations(void)
+{
+    const size_t in_use = mallinfo2().uordblks;
+
+    if (in_use <= heap_in_use)
+        return;
+
+    stats.heap_growths++;
+    LOG_E("heap in use has grown from %zu to %zu bytes after initialization", heap_in_use, in_use);
+    heap_in_use = in_use;
+}
+
+
+static void* run_background_thread(void *arg)
+{
+    thread_start *start = arg;
+    const char *name = start->name;
+    void* (*routine)(void*) = start->routine;
+
+    /*
+     * Do not inherit the real-time policy of the event loop, background work must never
+     * compete with the UPS polling. Waking a batch thread up never preempts the loop.
+     */
+    const struct sched_param param = {
+        .sched_priority = 0
+    };
+
+    if (sched_setscheduler(0, SCHED_BATCH, &param))
+        LOG_E("unable to set %s thread policy, error '%m'", name);
+
+    if (setpriority(PRIO_PROCESS, gettid(), BACKGROUND_NICE))
+        LOG_E("unable to set %s thread nice value %d, error '%m'", name, BACKGROUND_NICE);
+
+    LOG_D("%s thread started", name);
+
+    pthread_barrier_wait(&(start->barrier));  /* `start' is not valid after that */
+
+    return routine(NULL);
+}
+
+
+int start_background_thread(pthread_t *thread, const char *name, void* (*routine)(void*))
+{
+    pthread_attr_t attr;
+    thread_start start = {
+        .name = name,
+        .routine = routine
+    };
+
+    pthread_barrier_init(&(start.barrier), NULL, 2);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, BACKGROUND_STACK_SIZE);
+
+    const int ret = pthread_create(thread, &attr, run_background_thread, &start);
+
+    pthread_attr_destroy(&attr);
+
+    if (ret) {
+        LOG_E("unable to create %s thread, error '%s'", name, strerror(ret));
+        pthread_barrier_destroy(&(start.barrier));
+        return 1;
+    }
+
+    pthread_barrier_wait(&(start.barrier));
+    pthread_barrier_destroy(&(start.barrier));
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+#include <pthread.h>
+
+
+/*
+ * Lock all current and future pages in memory, disable returning heap memory
+ * to the system and prefault the stack. Must be called before dropping privileges.
+ * Return 0 on success and >0 on error.
+ */
+int lock_memory(void);
+
+/*
+ * Run the process with SCHED_FIFO policy and the given priority, fall back to
+ * the highest nice value if real-time scheduling is not permitted.
+ * Must be called before dropping privileges.
+ * Return 0 on success and >0 on error.
+ */
+int set_realtime_priority(const int priority);
+
+/*
+ * Reset the nice value raised by `set_realtime_priority()' in a forked child,
+ * the real-time policy is reset on fork by the kernel.
+ */
+void reset_priority(void);
+
+/*
+ * Remember amount of heap memory in use at the end of initialization.
+ */
+void mark_allocations(void);
+
+/*
+ * Check that heap memory in use has not grown since `mark_allocations()',
+ * count and log growths.
+ */
+void check_allocations(void);
+
+/*
+ * Start the thread with batch policy and lower priority for work that must not
+ * delay the event loop. The thread has logged its start before the function
+ * returns, so its memory is in use before `mark_allocations()'.
+ * Return 0 on success and >0 on error.
+ */
+int start_background_thread(pthread_t *thread, const char *name, void* (*routine)(void*));
+
+
+#endif /* REALTIME_H_ */
@@ -33,6 +33,8 @@ static const int quit_signals[] = {
 };
 #define QUIT_SIGNALS_COUNT (sizeof(quit_signals) / sizeof(quit_signals[0]))
 
+#define STATS_SIGNAL (SIGUSR1)  /* signal used for dump statistics */
+
 
 int register_quit_signals(void)
 {
@@ -64,6 +66,11 @@ int register_quit_signals(void)
             LOG_D("signal #%d ('%s') added", signum, strsignal(signum));
     }
 
+    if (sigaddset(&mask, STATS_SIGNAL)) {
+        LOG_E("unable to add signal %d, error '%m'", STATS_SIGNAL);
+        return -1;
+    }
+
     const int fd = signalfd(-1, &mask, SFD_CLOEXEC);
     if (fd < 0)
         LOG_E("unable to create signalfd, error '%m'");
@@ -89,6 +96,11 @@ int check_quit_signal(const int fd)
             return 0;
         }
 
+    if (signum == STATS_SIGNAL) {
+        LOG_D("got signal #%d ('%s'), dumping statistics", signum, strsignal(signum));
+        return 2;
+    }
+
     LOG_E("unknown signal #%d ('%s'), ignored", signum, strsignal(signum));
 
     return 1;
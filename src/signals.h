@@ -22,7 +22,7 @@
 
 
 /*
- * Register signals used for quit program.
+ * Register signals used for quit program and statistics dump.
  * Return the signal descriptor on success or -1 on error.
  */
 int register_quit_signals(void);
@@ -33,6 +33,7 @@ int register_quit_signals(void);
  *          -1 on error;
  *          0 if signal is quit signal;
  *          1 if signal is unknown;
+ *          2 if statistics dump is requested;
  */
 int check_quit_signal(const int fd);
 
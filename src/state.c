@@ -0,0 +1,142 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "state.h"
+#include "timer.h"
+
+
+#define STATE_MAGIC (0x53505346)  /* 'FSPS' */
+#define STATE_VERSION (1)
+#define BOOT_ID_PATH ("/proc/sys/kernel/random/boot_id")
+#define BOOT_ID_SIZE (40)
+
+
+typedef struct {
+    uint32_t magic;  /* STATE_MAGIC */
+    uint32_t version;  /* STATE_VERSION */
+    char boot_id[BOOT_ID_SIZE];  /* boot the state belongs to */
+    uint64_t offline_since;  /* time UPS became offline, 0 if it's online */
+    uint64_t last_sample;  /* time of the last sample */
+    uint32_t status;  /* status of the last sample */
+}
+persistent_state;
+
+
+static persistent_state *state = NULL;
+
+
+/*
+ * Read current boot ID.
+ * Return 0 on success and >0 on error.
+ */
+static int read_boot_id(char *boot_id)
+{
+    memset(boot_id, 0, BOOT_ID_SIZE);
+
+    FILE *file = fopen(BOOT_ID_PATH, "re");
+    if (file == NULL) {
+        LOG_E("unable to open '%s', error '%m'", BOOT_ID_PATH);
+        return 1;
+    }
+
+    const int ret = fgets(boot_id, BOOT_ID_SIZE, file) == NULL;
+    fclose(file);
+
+    if (ret)
+        LOG_E("unable to read boot ID");
+
+    return ret;
+}
+
+
+int open_state(const char *path, status_machine *machine, const uint64_t interval)
+{
+    char boot_id[BOOT_ID_SIZE];
+
+    if (read_boot_id(boot_id))
+        return 1;
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_E("unable to open state file '%s', error '%m'", path);
+        return 1;
+    }
+
+    if (ftruncate(fd, sizeof(persistent_state))) {
+        LOG_E("unable to resize state file '%s', error '%m'", path);
+        close(fd);
+        return 1;
+    }
+
+    state = mmap(NULL, sizeof(persistent_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (state == MAP_FAILED) {
+        LOG_E("unable to map state file '%s', error '%m'", path);
+        state = NULL;
+        return 1;
+    }
+
+    if (state->magic == STATE_MAGIC && state->version == STATE_VERSION
+            && !memcmp(state->boot_id, boot_id, BOOT_ID_SIZE)) {
+        resume_outage(machine, state->offline_since, state->last_sample, interval);
+        return 0;
+    }
+
+    memset(state, 0, sizeof(*state));
+    state->magic = STATE_MAGIC;
+    state->version = STATE_VERSION;
+    state->status = INVALID_RESPONSE;
+    memcpy(state->boot_id, boot_id, BOOT_ID_SIZE);
+
+    LOG_D("state file '%s' initialized", path);
+
+    return 0;
+}
+
+
+void save_state(const status_machine *machine, const ups_status status)
+{
+    if (state == NULL)
+        return;
+
+    state->offline_since = machine->offline_since;
+    state->last_sample = get_boot_time_ms();
+    state->status = status;
+}
+
+
+void close_state(void)
+{
+    if (state == NULL)
+        return;
+
+    if (munmap(state, sizeof(*state)))
+        LOG_E("unable to unmap state file, error '%m'");
+
+    state = NULL;
+}
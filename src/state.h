@@ -0,0 +1,46 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATE_H_
+#define STATE_H_
+
+#include "protocol.h"
+#include "status.h"
+
+
+/*
+ * Map the state file and restore the outage start into the status machine
+ * if the state was saved during the current boot (times are CLOCK_BOOTTIME based)
+ * and the last sample is recent enough for the query interval (ms), see `resume_outage()'.
+ * Return 0 on success and >0 on error.
+ */
+int open_state(const char *path, status_machine *machine, const uint64_t interval);
+
+/*
+ * Save the status machine state after the sample, do nothing if the file is not opened.
+ */
+void save_state(const status_machine *machine, const ups_status status);
+
+/*
+ * Unmap the state file.
+ */
+void close_state(void);
+
+
+#endif /* STATE_H_ */
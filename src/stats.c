@@ -0,0 +1,109 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "stats.h"
+
+
+stats_t stats;
+
+
+static const char *wake_names[WAKE_REASONS_COUNT] = {
+    "timer",
+    "port readable",
+    "signal"
+};
+
+
+uint64_t get_time_ns(void)
+{
+    struct timespec tm;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &tm))
+        return 0;
+
+    return (uint64_t) tm.tv_sec * 1000000000 + tm.tv_nsec;
+}
+
+
+void stats_account(uint64_t *total, uint64_t *max, const uint64_t start)
+{
+    const uint64_t elapsed = get_time_ns() - start;
+
+    *total += elapsed;
+    if (elapsed > *max)
+        *max = elapsed;
+}
+
+
+void stats_tick(const uint64_t now)
+{
+    static uint64_t last_tick = 0;
+    static uint64_t last_interval = 0;
+
+    if (last_tick) {
+        const uint64_t interval = now - last_tick;
+
+        if (last_interval) {
+            const uint64_t jitter = interval > last_interval ? interval - last_interval : last_interval - interval;
+
+            stats.ticks++;
+            stats.jitter_ns_total += jitter;
+            if (jitter > stats.jitter_ns_max)
+                stats.jitter_ns_max = jitter;
+        }
+
+        last_interval = interval;
+    }
+
+    last_tick = now;
+}
+
+
+void dump_stats(void)
+{
+    LOG_I("stats: iterations=%" PRIu64 ", poll errors=%" PRIu64 ", syscalls=%" PRIu64,
+          stats.iterations, stats.poll_errors, stats.syscalls);
+
+    for (size_t i = 0; i < WAKE_REASONS_COUNT; i++)
+        LOG_I("stats: wakes by %s=%" PRIu64, wake_names[i], stats.wakes[i]);
+
+    LOG_I("stats: wakes by client socket=%" PRIu64, atomic_load_explicit(&stats.client_wakes, memory_order_relaxed));
+
+    LOG_I("stats: iteration time avg=%" PRIu64 " ns, max=%" PRIu64 " ns",
+          stats.iterations ? stats.loop_ns_total / stats.iterations : 0, stats.loop_ns_max);
+
+    LOG_I("stats: updates=%" PRIu64 ", update time avg=%" PRIu64 " ns, max=%" PRIu64 " ns",
+          stats.updates, stats.updates ? stats.update_ns_total / stats.updates : 0, stats.update_ns_max);
+
+    LOG_I("stats: invalid responses=%" PRIu64 ", missed samples=%" PRIu64,
+          stats.invalid_responses, stats.missed_samples);
+
+    LOG_I("stats: sampling jitter avg=%" PRIu64 " ns, max=%" PRIu64 " ns",
+          stats.ticks ? stats.jitter_ns_total / stats.ticks : 0, stats.jitter_ns_max);
+
+    LOG_I("stats: dropped events=%" PRIu64 ", dropped samples=%" PRIu64 ", heap growths=%" PRIu64,
+          atomic_load_explicit(&stats.dropped_events, memory_order_relaxed), stats.dropped_samples, stats.heap_growths);
+
+    if (stats.updates)
+        LOG_I("stats: syscalls per update=%.2f", (double) stats.syscalls / stats.updates);
+}
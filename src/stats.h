@@ -0,0 +1,84 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+
+typedef enum {
+    WAKE_TIMER,
+    WAKE_PORT_IN,
+    WAKE_SIGNAL,
+    WAKE_REASONS_COUNT
+}
+wake_reason;
+
+
+typedef struct {
+    uint64_t iterations;  /* amount of event loop iterations */
+    uint64_t wakes[WAKE_REASONS_COUNT];  /* amount of event loop wakes by reason */
+    uint64_t poll_errors;  /* amount of failed poll() calls */
+    uint64_t syscalls;  /* amount of system calls made by the event loop */
+    uint64_t loop_ns_total, loop_ns_max;  /* time spent processing events */
+    uint64_t updates;  /* amount of UPS status updates */
+    uint64_t invalid_responses;  /* amount of responses which could not be parsed */
+    uint64_t missed_samples;  /* amount of requests without response until the next tick */
+    uint64_t update_ns_total, update_ns_max;  /* time spent in status updates */
+    uint64_t ticks;  /* amount of timer ticks used for jitter */
+    uint64_t jitter_ns_total, jitter_ns_max;  /* difference between successive tick intervals */
+    uint64_t dropped_samples;  /* amount of samples dropped because the export thread is behind */
+    uint64_t heap_growths;  /* amount of heap growths after initialization (debug mode only) */
+    /* updated by the export thread only, read with relaxed atomic loads */
+    _Atomic uint64_t client_wakes;  /* amount of export thread wakes by the client sockets */
+    _Atomic uint64_t dropped_events;  /* amount of events dropped for slow subscribers */
+}
+stats_t;
+
+
+/*
+ * Event loop statistics, allocated statically to avoid allocations in the loop.
+ */
+extern stats_t stats;
+
+
+/*
+ * Return current monotonic time in nanoseconds.
+ */
+uint64_t get_time_ns(void);
+
+/*
+ * Account the time elapsed since `start' to the total and maximum counters.
+ */
+void stats_account(uint64_t *total, uint64_t *max, const uint64_t start);
+
+/*
+ * Account the timer tick at the given time for the sampling jitter.
+ */
+void stats_tick(const uint64_t now);
+
+/*
+ * Write all statistics to the log.
+ */
+void dump_stats(void);
+
+
+#endif /* STATS_H_ */
@@ -0,0 +1,133 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <inttypes.h>
+
+#include "actions.h"
+#include "log.h"
+#include "privileges.h"
+#include "probes.h"
+#include "status.h"
+#include "timer.h"
+
+
+const status_ops system_status_ops = {
+    .get_time = get_boot_time_ms,  /* keeps counting while suspended */
+    .update_actions = update_actions,
+    .shutdown = run_shutdown
+};
+
+
+void init_status(status_machine *machine, const status_ops *ops, const unsigned int delay)
+{
+    machine->ops = ops;
+    machine->delay = (uint64_t) delay * 1000;
+    machine->offline_since = 0;
+}
+
+
+int update_state(status_machine *machine, const ups_status status, const ups_sample *sample)
+{
+    const status_ops *ops = machine->ops;
+
+    switch (status) {
+        case UPS_ONLINE:
+            ops->update_actions(sample, 0, 0);
+            if (machine->offline_since) {
+                const uint64_t offline_ms = ops->get_time() - machine->offline_since;
+                PROBE1(online, offline_ms);
+                LOG_I("UPS became online after %" PRIu64 " ms offline, system shutdown canceled", offline_ms);
+                machine->offline_since = 0;
+            }
+            else
+                LOG_D("UPS is online");
+            return 1;
+
+        case UPS_OFFLINE:
+            break;
+
+        default:
+            return -1;
+    }
+
+    const uint64_t cur_time = ops->get_time();
+    if (!cur_time)
+        return -1;
+
+    const int became_offline = !machine->offline_since;
+
+    if (became_offline)
+        machine->offline_since = cur_time;
+
+    const uint64_t delta = cur_time - machine->offline_since;
+
+    ops->update_actions(sample, 1, delta);
+
+    if (became_offline) {
+        PROBE1(offline, cur_time);
+        LOG_I("UPS became offline at %" PRIu64 ".%03" PRIu64 " s, %" PRIu64 " sec left before system shutdown",
+              cur_time / 1000, cur_time % 1000, machine->delay / 1000);
+        return 1;
+    }
+
+    PROBE2(countdown, delta, delta < machine->delay ? machine->delay - delta : 0);
+
+    if (delta < machine->delay) {
+        LOG_I("UPS is offline, %" PRIu64 " sec left before system shutdown", (machine->delay - delta + 999) / 1000);
+        return 1;
+    }
+
+    machine->offline_since = 0;
+    LOG_I("shutdown delay is over, going to shutdown system");
+
+    PROBE0(shutdown_start);
+
+    int ret = ops->shutdown();
+
+    PROBE1(shutdown_done, ret);
+    if (ret)
+        LOG_E("unable to execute command 'shutdown', ret=%d", ret);
+    else
+        LOG_I("shutdown in progress, 1 minute left");
+
+    return ret;
+}
+
+
+int resume_outage(status_machine *machine, const uint64_t offline_since, const uint64_t last_sample,
+                  const uint64_t interval)
+{
+    const uint64_t now = machine->ops->get_time();
+
+    if (!offline_since || !now || offline_since > last_sample || last_sample > now)
+        return 0;
+
+    if (now - last_sample > interval + RESUME_GAP_MS) {
+        LOG_I("outage started %" PRIu64 " ms ago is not resumed, last sample %" PRIu64 " ms ago",
+              now - offline_since, now - last_sample);
+        return 0;
+    }
+
+    machine->offline_since = offline_since;
+
+    LOG_I("resuming outage started %" PRIu64 " ms ago, last sample %" PRIu64 " ms ago",
+          now - offline_since, now - last_sample);
+
+    return 1;
+}
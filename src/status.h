@@ -0,0 +1,82 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATUS_H_
+#define STATUS_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+
+#define RESUME_GAP_MS (10000)  /* max restart time on top of the query interval to resume the outage */
+
+
+/*
+ * Clock and actions used by the status machine, real ones are used by the
+ * daemon and virtual ones can be used to replay samples without waiting.
+ */
+typedef struct {
+    uint64_t (*get_time)(void);  /* current time in milliseconds, 0 on error */
+    void (*update_actions)(const ups_sample *sample, const int offline, const uint64_t offline_ms);
+    int (*shutdown)(void);  /* return 0 if shutdown is in progress */
+}
+status_ops;
+
+
+typedef struct {
+    const status_ops *ops;
+    uint64_t delay;  /* delay before shutdown, milliseconds */
+    uint64_t offline_since;  /* time UPS became offline, 0 if it's online */
+}
+status_machine;
+
+
+/*
+ * Real clock (CLOCK_BOOTTIME) and actions (load shedding and `shutdown').
+ */
+extern const status_ops system_status_ops;
+
+
+/*
+ * Initialize the status machine with the delay before shutdown in seconds.
+ */
+void init_status(status_machine *machine, const status_ops *ops, const unsigned int delay);
+
+/*
+ * Update the status machine with the UPS status and run `shutdown' if UPS is offline for too long.
+ * Sample may be NULL if the response is invalid.
+ * Return:
+ *          -1 on error;
+ *          0 if the system is going to shutdown;
+ *          1 if UPS is online;
+ */
+int update_state(status_machine *machine, const ups_status status, const ups_sample *sample);
+
+/*
+ * Resume the outage saved before the restart. It is resumed only if the last sample
+ * was taken not more than the query interval (ms) plus RESUME_GAP_MS ago, otherwise
+ * the power could have returned and failed again meanwhile.
+ * Return 1 if the outage is resumed and 0 otherwise.
+ */
+int resume_outage(status_machine *machine, const uint64_t offline_since, const uint64_t last_sample,
+                  const uint64_t interval);
+
+
+#endif /* STATUS_H_ */
@@ -0,0 +1,607 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "policy.h"
+#include "stats.h"
+#include "subscribers.h"
+
+
+#define QUEUE_SIZE (16)  /* events queued per client */
+#define LINE_SIZE (512)  /* max size of formatted event */
+#define INPUT_SIZE (16)  /* max size of client command */
+
+
+typedef enum {
+    EVENT_STATE,
+    EVENT_SAMPLE,
+    EVENT_CHANGE,
+    EVENT_POLICY,
+    EVENT_BATTERY,
+    EVENT_QUALITY
+}
+event_type;
+
+
+typedef struct {
+    event_type type;
+    uint64_t time;  /* wall clock time, milliseconds since Epoch */
+    unsigned int feed;
+    ups_status status;
+    ups_sample sample;
+    policy_result policy;  /* EVENT_POLICY only */
+    battery_result battery;  /* EVENT_BATTERY only */
+    quality_result quality;  /* EVENT_QUALITY only */
+    uint32_t dropped;  /* amount of events dropped before this one */
+}
+event_t;
+
+
+typedef struct {
+    int fd;  /* -1 if the slot is free */
+    int all_samples;  /* send every sample, not only changes */
+    event_t queue[QUEUE_SIZE];
+    unsigned int head, count;
+    char line[LINE_SIZE];  /* event being sent */
+    size_t line_size, line_sent;
+    char input[INPUT_SIZE];  /* incomplete command */
+    size_t input_size;
+}
+client_t;
+
+
+static int listen_fd = -1;
+static char socket_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+static dev_t socket_dev;  /* identity of the socket file bound by this process */
+static ino_t socket_ino;
+static client_t clients[MAX_SUBSCRIBERS];
+static event_t last_events[MAX_FEEDS];  /* the latest state of each feed */
+static event_t last_policy;  /* the latest rules evaluation, sent if there are several feeds */
+
+
+static const char *status_names[] = {
+    "online",
+    "offline",
+    "invalid"
+};
+
+static const char *event_names[] = {
+    "state",
+    "sample",
+    "change",
+    "policy",
+    "battery",
+    "quality"
+};
+
+static const char *discharge_names[] = {
+    "outage",
+    "test"
+};
+
+
+/*
+ * Check if another process listens on the socket.
+ * Return 1 if it does, 0 if there is no socket or it is stale.
+ */
+static int is_socket_used(const struct sockaddr_un *addr)
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+
+    const int used = !connect(fd, (const struct sockaddr*) addr, sizeof(*addr));
+
+    close(fd);
+
+    return used;
+}
+
+
+int open_subscribers(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG_E("socket path '%s' is too long", path);
+        return 1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++)
+        clients[i].fd = -1;
+
+    memset(last_events, 0, sizeof(last_events));
+    for (unsigned int i = 0; i < MAX_FEEDS; i++) {
+        last_events[i].feed = i;
+        last_events[i].status = INVALID_RESPONSE;
+    }
+
+    memset(&last_policy, 0, sizeof(last_policy));
+    last_policy.type = EVENT_POLICY;
+    last_policy.policy.feeds = get_feeds_count();
+
+    if (is_socket_used(&addr)) {
+        LOG_E("socket '%s' is used by another process, e.g. the daemon", path);
+        return 1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        LOG_E("unable to create socket, error '%m'");
+        return 1;
+    }
+
+    unlink(path);  /* stale socket from the previous run */
+
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(listen_fd, MAX_SUBSCRIBERS)
+            || stat(path, &st)) {
+        LOG_E("unable to listen on socket '%s', error '%m'", path);
+        close(listen_fd);
+        listen_fd = -1;
+        return 1;
+    }
+
+    socket_dev = st.st_dev;
+    socket_ino = st.st_ino;
+
+    strcpy(socket_path, path);
+
+    LOG_I("listening for subscribers on '%s'", path);
+
+    return 0;
+}
+
+
+static void drop_client(client_t *client)
+{
+    LOG_D("subscriber #%d disconnected", client->fd);
+
+    if (close(client->fd))
+        LOG_E("unable to close subscriber #%d, error '%m'", client->fd);
+
+    client->fd = -1;
+}
+
+
+/*
+ * Queue the latest state of all feeds and the rules evaluation.
+ */
+static void queue_states(client_t *client, const uint32_t dropped)
+{
+    const unsigned int feeds = get_feeds_count();
+
+    for (unsigned int i = 0; i < feeds; i++) {
+        event_t *state = &(client->queue[(client->head + client->count++) % QUEUE_SIZE]);
+        *state = last_events[i];
+        state->type = EVENT_STATE;
+        state->dropped = i ? 0 : dropped;
+    }
+
+    if (feeds > 1)
+        client->queue[(client->head + client->count++) % QUEUE_SIZE] = last_policy;
+}
+
+
+/*
+ * Queue the event, when the queue is full replace it and the queued events with the latest states.
+ * The first state carries the amount of dropped events, including drops not reported yet.
+ */
+static void queue_event(client_t *client, const event_t *event)
+{
+    if (client->count == QUEUE_SIZE) {
+        uint32_t dropped = client->count + 1;
+
+        for (unsigned int i = 0; i < client->count; i++)
+            dropped += client->queue[(client->head + i) % QUEUE_SIZE].dropped;
+
+        atomic_fetch_add_explicit(&stats.dropped_events, client->count + 1, memory_order_relaxed);
+        client->head = 0;
+        client->count = 0;
+        queue_states(client, dropped);
+        return;
+    }
+
+    client->queue[(client->head + client->count++) % QUEUE_SIZE] = *event;
+}
+
+
+static void accept_client(void)
+{
+    for (;;) {
+        const int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_E("unable to accept subscriber, error '%m'");
+            return;
+        }
+
+        client_t *client = NULL;
+
+        for (int i = 0; i < MAX_SUBSCRIBERS && client == NULL; i++)
+            if (clients[i].fd < 0)
+                client = &(clients[i]);
+
+        if (client == NULL) {
+            LOG_E("too many subscribers, max %d", MAX_SUBSCRIBERS);
+            close(fd);
+            continue;
+        }
+
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+
+        queue_states(client, 0);
+
+        LOG_D("subscriber #%d connected", fd);
+    }
+}
+
+
+/*
+ * Read commands from the client.
+ * Return 0 on success and >0 if the client has to be dropped.
+ */
+static int read_client(client_t *client)
+{
+    char buf[64];
+
+    const ssize_t size = read(client->fd, buf, sizeof(buf));
+
+    if (size < 0)
+        return errno != EAGAIN && errno != EWOULDBLOCK;
+
+    if (!size)
+        return 1;
+
+    for (ssize_t i = 0; i < size; i++) {
+        if (buf[i] != '\n') {
+            if (client->input_size < INPUT_SIZE - 1)
+                client->input[client->input_size++] = buf[i];
+            continue;
+        }
+
+        client->input[client->input_size] = '\0';
+        client->input_size = 0;
+
+        if (!strcmp(client->input, "all"))
+            client->all_samples = 1;
+        else if (!strcmp(client->input, "changes"))
+            client->all_samples = 0;
+        else
+            LOG_D("subscriber #%d sent unknown command '%s'", client->fd, client->input);
+    }
+
+    return 0;
+}
+
+
+static int format_value(char *buf, const size_t size, const char *name, const float value)
+{
+    if (isnan(value))
+        return snprintf(buf, size, ",\"%s\":null", name);
+
+    return snprintf(buf, size, ",\"%s\":%.1f", name, value);
+}
+
+
+static int format_series(char *buf, const size_t size, const char *name, const quality_series *series)
+{
+    int len = snprintf(buf, size, ",\"%s\":{\"samples\":%" PRIu32, name, series->samples);
+
+    len += format_value(buf + len, size - len, "ewma", series->ewma);
+    len += format_value(buf + len, size - len, "min", series->min);
+    len += format_value(buf + len, size - len, "max", series->max);
+    len += format_value(buf + len, size - len, "p1", series->p1);
+    len += format_value(buf + len, size - len, "p50", series->p50);
+    len += format_value(buf + len, size - len, "p99", series->p99);
+    len += snprintf(buf + len, size - len, "}");
+
+    return len;
+}
+
+
+static size_t format_event(char *buf, const size_t size, const event_t *event)
+{
+    const ups_sample *sample = &(event->sample);
+
+    if (event->type == EVENT_POLICY) {
+        const policy_result *policy = &(event->policy);
+
+        return snprintf(buf, size, "{\"event\":\"policy\",\"time\":%" PRIu64 ",\"feeds\":%u,\"on_battery\":%u,"
+                        "\"low\":%u,\"lost\":%u,\"met\":%s}\n",
+                        event->time, policy->feeds, policy->on_battery, policy->low, policy->lost,
+                        policy->met ? "true" : "false");
+    }
+
+    if (event->type == EVENT_BATTERY) {
+        const battery_result *battery = &(event->battery);
+
+        int len = snprintf(buf, size, "{\"event\":\"battery\",\"time\":%" PRIu64 ",\"feed\":%u,\"kind\":\"%s\","
+                           "\"samples\":%u,\"rate\":%.2f,\"baseline\":%.2f",
+                           event->time, battery->feed, discharge_names[battery->kind], battery->samples,
+                           battery->rate, battery->baseline);
+
+        if (isnan(battery->capacity))
+            len += snprintf(buf + len, size - len, ",\"capacity\":null}\n");
+        else
+            len += snprintf(buf + len, size - len, ",\"capacity\":%.3f}\n", battery->capacity);
+
+        return len;
+    }
+
+    if (event->type == EVENT_QUALITY) {
+        const quality_result *quality = &(event->quality);
+
+        int len = snprintf(buf, size, "{\"event\":\"quality\",\"time\":%" PRIu64 ",\"feed\":%u",
+                           event->time, event->feed);
+
+        len += format_series(buf + len, size - len, "voltage", &(quality->voltage));
+        len += format_series(buf + len, size - len, "frequency", &(quality->frequency));
+        len += snprintf(buf + len, size - len, ",\"sags\":%" PRIu32 ",\"longest_sag\":%" PRIu64
+                        ",\"surges\":%" PRIu32 ",\"longest_surge\":%" PRIu64,
+                        quality->sags, quality->longest_sag, quality->surges, quality->longest_surge);
+        len += format_value(buf + len, size - len, "fault_min", quality->fault_min);
+        len += snprintf(buf + len, size - len, "}\n");
+
+        return len;
+    }
+
+    int len = snprintf(buf, size, "{\"event\":\"%s\",\"time\":%" PRIu64 ",\"feed\":%u,\"status\":\"%s\"",
+                       event_names[event->type], event->time, event->feed, status_names[event->status]);
+
+    if (event->status != INVALID_RESPONSE) {
+        len += format_value(buf + len, size - len, "input_voltage", sample->input_voltage);
+        len += format_value(buf + len, size - len, "fault_voltage", sample->fault_voltage);
+        len += format_value(buf + len, size - len, "output_voltage", sample->output_voltage);
+        len += format_value(buf + len, size - len, "load", sample->load);
+        len += format_value(buf + len, size - len, "frequency", sample->frequency);
+        len += format_value(buf + len, size - len, "battery_voltage", sample->battery_voltage);
+        len += format_value(buf + len, size - len, "temperature", sample->temperature);
+        len += snprintf(buf + len, size - len, ",\"flags\":\"%02X\"", sample->flags);
+    }
+
+    if (event->dropped)
+        len += snprintf(buf + len, size - len, ",\"dropped\":%" PRIu32, event->dropped);
+
+    len += snprintf(buf + len, size - len, "}\n");
+
+    return len;
+}
+
+
+/*
+ * Write queued events to the client until the socket is full.
+ * Return 0 on success and >0 if the client has to be dropped.
+ */
+static int write_client(client_t *client)
+{
+    for (;;) {
+        if (client->line_sent == client->line_size) {
+            if (!client->count)
+                return 0;
+
+            client->line_size = format_event(client->line, sizeof(client->line), &(client->queue[client->head]));
+            client->line_sent = 0;
+            client->head = (client->head + 1) % QUEUE_SIZE;
+            client->count--;
+        }
+
+        const ssize_t size = send(client->fd, client->line + client->line_sent,
+                                  client->line_size - client->line_sent, MSG_NOSIGNAL);
+        if (size < 0)
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+
+        client->line_sent += size;
+    }
+}
+
+
+int get_subscribers_pollfds(struct pollfd *fds)
+{
+    int count = 0;
+
+    if (listen_fd < 0)
+        return 0;
+
+    fds[count].fd = listen_fd;
+    fds[count].events = POLLIN;
+    fds[count++].revents = 0;
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        const client_t *client = &(clients[i]);
+
+        if (client->fd < 0)
+            continue;
+
+        fds[count].fd = client->fd;
+        fds[count].events = POLLIN;
+        if (client->count || client->line_sent < client->line_size)
+            fds[count].events |= POLLOUT;
+        fds[count++].revents = 0;
+    }
+
+    return count;
+}
+
+
+int process_subscribers(const struct pollfd *fds, const int count)
+{
+    int ready = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!fds[i].revents)
+            continue;
+
+        ready++;
+
+        if (fds[i].fd == listen_fd) {
+            accept_client();
+            continue;
+        }
+
+        for (int j = 0; j < MAX_SUBSCRIBERS; j++) {
+            client_t *client = &(clients[j]);
+
+            if (client->fd != fds[i].fd)
+                continue;
+
+            if ((fds[i].revents & (POLLERR | POLLNVAL))
+                    || ((fds[i].revents & (POLLIN | POLLHUP)) && read_client(client))
+                    || ((fds[i].revents & POLLOUT) && write_client(client)))
+                drop_client(client);
+            break;
+        }
+    }
+
+    return ready;
+}
+
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec tm;
+
+    if (clock_gettime(CLOCK_REALTIME, &tm))
+        return 0;
+
+    return (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+}
+
+
+static void queue_all(const event_t *event, const int changed)
+{
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        client_t *client = &(clients[i]);
+
+        if (client->fd >= 0 && (changed || client->all_samples))
+            queue_event(client, event);
+    }
+}
+
+
+void publish_sample(const unsigned int feed, const ups_status status, const ups_sample *sample)
+{
+    event_t event;
+    event_t *last_event = &(last_events[feed]);
+
+    if (listen_fd < 0)
+        return;
+
+    memset(&event, 0, sizeof(event));
+    event.feed = feed;
+    event.status = status;
+    event.time = get_time_ms();
+
+    if (sample != NULL)
+        event.sample = *sample;
+
+    const int changed = status != last_event->status || event.sample.flags != last_event->sample.flags;
+    event.type = changed ? EVENT_CHANGE : EVENT_SAMPLE;
+    *last_event = event;
+
+    queue_all(&event, changed);
+}
+
+
+void publish_policy(const policy_result *policy)
+{
+    if (listen_fd < 0)
+        return;
+
+    last_policy.time = get_time_ms();
+    last_policy.policy = *policy;
+    last_policy.policy.sample = NULL;  /* points to the state of the other thread */
+
+    queue_all(&last_policy, 1);
+}
+
+
+void publish_battery(const battery_result *battery)
+{
+    event_t event;
+
+    if (listen_fd < 0)
+        return;
+
+    memset(&event, 0, sizeof(event));
+    event.type = EVENT_BATTERY;
+    event.time = get_time_ms();
+    event.feed = battery->feed;
+    event.battery = *battery;
+
+    queue_all(&event, 1);
+}
+
+
+void publish_quality(const quality_result *quality)
+{
+    event_t event;
+
+    if (listen_fd < 0)
+        return;
+
+    memset(&event, 0, sizeof(event));
+    event.type = EVENT_QUALITY;
+    event.time = get_time_ms();
+    event.feed = 0;  /* line quality is of the first feed */
+    event.quality = *quality;
+
+    queue_all(&event, 1);
+}
+
+
+void close_subscribers(void)
+{
+    struct stat st;
+
+    if (listen_fd < 0)
+        return;
+
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++)
+        if (clients[i].fd >= 0)
+            drop_client(&(clients[i]));
+
+    if (close(listen_fd))
+        LOG_E("unable to close socket, error '%m'");
+
+    /* the path may have been taken over by another process meanwhile */
+    if (stat(socket_path, &st) || st.st_dev != socket_dev || st.st_ino != socket_ino)
+        LOG_I("socket '%s' is not ours anymore, it is left in place", socket_path);
+    else if (unlink(socket_path))
+        LOG_E("unable to remove socket '%s', error '%m'", socket_path);
+
+    listen_fd = -1;
+}
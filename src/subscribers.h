@@ -0,0 +1,92 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SUBSCRIBERS_H_
+#define SUBSCRIBERS_H_
+
+#include <poll.h>
+
+#include "battery.h"
+#include "policy.h"
+#include "protocol.h"
+#include "quality.h"
+
+
+#define MAX_SUBSCRIBERS (32)
+#define SUBSCRIBERS_POLLFDS (MAX_SUBSCRIBERS + 1)  /* listening socket and clients */
+
+
+/*
+ * Subscribers connect to the Unix socket and receive JSON lines:
+ *      {"event":"state"|"sample"|"change","time":<ms>,"feed":<N>,"status":"online"|"offline"|"invalid",...}
+ *      {"event":"policy","time":<ms>,"feeds":<N>,"on_battery":<N>,"low":<N>,"lost":<N>,"met":true|false}
+ *      {"event":"battery","time":<ms>,"feed":<N>,"kind":"outage"|"test","samples":<N>,"rate":<mV/min/%>,...}
+ *      {"event":"quality","time":<ms>,"feed":0,"voltage":{"samples":<N>,"ewma":<V>,...},"frequency":{...},...}
+ * The first lines are the current state of each feed and, if there are several
+ * feeds, the shutdown rules evaluation. By default only changes of status or
+ * status bits are sent, a client sends "all\n" to get every sample and
+ * "changes\n" to get changes only. Each client has a bounded queue, when it's
+ * full the queue is replaced by the latest state, so slow clients never block.
+ */
+
+/*
+ * Create the listening socket at the given path.
+ * Return 0 on success and >0 on error.
+ */
+int open_subscribers(const char *path);
+
+/*
+ * Fill poll descriptors for the listening socket and clients.
+ * Return amount of filled descriptors.
+ */
+int get_subscribers_pollfds(struct pollfd *fds);
+
+/*
+ * Process events on descriptors filled by `get_subscribers_pollfds()'.
+ * Return amount of descriptors with events.
+ */
+int process_subscribers(const struct pollfd *fds, const int count);
+
+/*
+ * Queue the sample (NULL if the response is invalid) for subscribers.
+ */
+void publish_sample(const unsigned int feed, const ups_status status, const ups_sample *sample);
+
+/*
+ * Queue the changed shutdown rules evaluation for subscribers.
+ */
+void publish_policy(const policy_result *policy);
+
+/*
+ * Queue the fitted battery discharge for subscribers.
+ */
+void publish_battery(const battery_result *battery);
+
+/*
+ * Queue line quality statistics of the window for subscribers.
+ */
+void publish_quality(const quality_result *quality);
+
+/*
+ * Disconnect all clients and remove the socket.
+ */
+void close_subscribers(void);
+
+
+#endif /* SUBSCRIBERS_H_ */
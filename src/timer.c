@@ -17,32 +17,72 @@
     along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <time.h>
 #include <unistd.h>
+#include <sys/prctl.h>
 #include <sys/timerfd.h>
 
 #include "log.h"
+#include "timer.h"
 
 
-int create_timer(const unsigned int timeout)
+uint64_t get_boot_time_ms(void)
 {
-    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct timespec tm;
+
+    if (clock_gettime(CLOCK_BOOTTIME, &tm)) {
+        LOG_E("unable to get current time, error '%m'");
+        return 0;
+    }
+
+    return (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+}
+
+
+int create_timer(const unsigned int timeout, const unsigned int slack)
+{
+    struct timespec now;
+    const uint64_t granularity = (uint64_t) slack * 1000000;
+
+    if (slack && prctl(PR_SET_TIMERSLACK, (unsigned long) slack * 1000000, 0, 0, 0)) {
+        LOG_E("unable to set timer slack %u ms, error '%m'", slack);
+        return -1;
+    }
+
+    if (clock_gettime(CLOCK_BOOTTIME, &now)) {
+        LOG_E("unable to get current time, error '%m'");
+        return -1;
+    }
+
+    const int fd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC);
     if (fd < 0) {
         LOG_E("unable to create timer fd, error '%m'");
         return -1;
     }
 
+    /*
+     * timerfd expirations are not deferred by the timer slack, so the first
+     * expiration is rounded up to the slack granularity instead. The period is
+     * whole seconds and the slack divides a second, so all ticks stay on the grid
+     * and coincide with other wakeups aligned the same way in the system.
+     */
+    uint64_t first = ((uint64_t) now.tv_sec + timeout) * 1000000000 + now.tv_nsec;
+
+    if (granularity)
+        first = (first + granularity - 1) / granularity * granularity;
+
     struct itimerspec tm = {
         .it_interval = {
             .tv_sec = timeout,
             .tv_nsec = 0
         },
         .it_value = {
-            .tv_sec = timeout,
-            .tv_nsec = 0
+            .tv_sec = first / 1000000000,
+            .tv_nsec = first % 1000000000
         }
     };
 
-    if (!timerfd_settime(fd, 0, &tm, NULL))
+    if (!timerfd_settime(fd, TFD_TIMER_ABSTIME, &tm, NULL))
         return fd;
 
     LOG_E("unable to set timerfd value, error '%m'");
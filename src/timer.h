@@ -20,12 +20,21 @@
 #ifndef TIMER_H_
 #define TIMER_H_
 
+#include <stdint.h>
+
+
+/*
+ * Return time since boot including suspend in milliseconds or 0 on error.
+ */
+uint64_t get_boot_time_ms(void);
 
 /*
- * Create new timer.
+ * Create new timer with the given period (seconds) based on CLOCK_BOOTTIME.
+ * Non-zero slack (milliseconds, divides a second) is applied to the process timers
+ * and ticks are aligned to its multiples, so the wakeups can be coalesced.
  * Return the timer descriptor on success or -1 on error.
  */
-int create_timer(const unsigned int timeout);
+int create_timer(const unsigned int timeout, const unsigned int slack);
 
 
 #endif /* TIMER_H_ */
@@ -0,0 +1,211 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "stats.h"
+#include "uring.h"
+
+
+/*
+ * The rings are shared with the kernel, the kernel moves the submission head
+ * and the completion tail, the process moves the submission tail and the
+ * completion head. liburing is not used to keep the dependencies as they are,
+ * only the few operations of the event loop are needed.
+ */
+static int ring_fd = -1;
+static char *ring_ptr = MAP_FAILED;
+static size_t ring_size = 0;
+static struct io_uring_sqe *sqes = MAP_FAILED;
+static size_t sqes_size = 0;
+
+static unsigned int *sq_head, *sq_tail, *sq_array;
+static unsigned int sq_mask, sq_entries = 0;
+static unsigned int sqe_tail = 0;  /* the tail including filled but not submitted entries */
+
+static unsigned int *cq_head, *cq_tail;
+static unsigned int cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* room for all opcodes, the kernel fills up to `last_op' */
+static union {
+    struct io_uring_probe probe;
+    unsigned char buf[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+}
+probe;
+
+
+static int check_ops(const unsigned char *ops, const unsigned int ops_count)
+{
+    memset(&probe, 0, sizeof(probe));
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, &probe, 256) < 0) {
+        LOG_E("unable to probe io_uring operations, error '%m'");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < ops_count; i++)
+        if (ops[i] > probe.probe.last_op || !(probe.probe.ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            LOG_E("io_uring operation %u is not supported", ops[i]);
+            return 1;
+        }
+
+    return 0;
+}
+
+
+int open_uring(const unsigned int entries, const unsigned char *ops, const unsigned int ops_count)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+        LOG_E("unable to set up io_uring, error '%m'");
+        return 1;
+    }
+
+    /* the kernels with both rings in one mapping also have all operations used here */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        LOG_E("io_uring of this kernel is too old");
+        goto on_error;
+    }
+
+    if (check_ops(ops, ops_count))
+        goto on_error;
+
+    ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if (ring_size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+        ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring_ptr == MAP_FAILED) {
+        LOG_E("unable to map io_uring rings, error '%m'");
+        goto on_error;
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        LOG_E("unable to map io_uring submission entries, error '%m'");
+        goto on_error;
+    }
+
+    sq_head = (unsigned int *) (ring_ptr + params.sq_off.head);
+    sq_tail = (unsigned int *) (ring_ptr + params.sq_off.tail);
+    sq_array = (unsigned int *) (ring_ptr + params.sq_off.array);
+    sq_mask = *(unsigned int *) (ring_ptr + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sqe_tail = *sq_tail;
+
+    cq_head = (unsigned int *) (ring_ptr + params.cq_off.head);
+    cq_tail = (unsigned int *) (ring_ptr + params.cq_off.tail);
+    cq_mask = *(unsigned int *) (ring_ptr + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (ring_ptr + params.cq_off.cqes);
+
+    LOG_I("io_uring is set up with %u submission and %u completion entries", params.sq_entries, params.cq_entries);
+
+    return 0;
+
+on_error:
+
+    close_uring();
+
+    return 1;
+}
+
+
+unsigned int free_sqes(void)
+{
+    return sq_entries - (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+}
+
+
+struct io_uring_sqe *get_sqe(void)
+{
+    if (!free_sqes())
+        return NULL;
+
+    const unsigned int index = sqe_tail & sq_mask;
+    struct io_uring_sqe *sqe = &(sqes[index]);
+
+    sq_array[index] = index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe_tail++;
+
+    return sqe;
+}
+
+
+int enter_uring(const unsigned int wait)
+{
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+    const unsigned int submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+    if (!submit && !wait)
+        return 0;
+
+    stats.syscalls++;
+
+    if (syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+struct io_uring_cqe *peek_cqe(void)
+{
+    const unsigned int head = *cq_head;
+
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &(cqes[head & cq_mask]);
+}
+
+
+void seen_cqe(void)
+{
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+void close_uring(void)
+{
+    if (sqes != MAP_FAILED && munmap(sqes, sqes_size))
+        LOG_E("unable to unmap io_uring submission entries, error '%m'");
+
+    if (ring_ptr != MAP_FAILED && munmap(ring_ptr, ring_size))
+        LOG_E("unable to unmap io_uring rings, error '%m'");
+
+    if (ring_fd >= 0 && close(ring_fd))
+        LOG_E("unable to close io_uring #%d, error '%m'", ring_fd);
+
+    sqes = MAP_FAILED;
+    ring_ptr = MAP_FAILED;
+    sq_entries = 0;
+    ring_fd = -1;
+}
@@ -0,0 +1,61 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef URING_H_
+#define URING_H_
+
+#include <linux/io_uring.h>
+
+
+/*
+ * Create the io_uring instance with `entries' submission entries, the kernel must support all `ops'.
+ * The ring is used by the event loop thread only, there is no locking.
+ * Return 0 on success and >0 on error (e.g. old kernel, io_uring disabled by sysctl or seccomp).
+ */
+int open_uring(const unsigned int entries, const unsigned char *ops, const unsigned int ops_count);
+
+/*
+ * Return the amount of submission entries which can be filled before the next submission.
+ */
+unsigned int free_sqes(void);
+
+/*
+ * Return the cleared submission entry to fill or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *get_sqe(void);
+
+/*
+ * Submit all filled entries and wait for at least `wait' completions.
+ * Return 0 on success or -1 with errno set on error.
+ */
+int enter_uring(const unsigned int wait);
+
+/*
+ * Return the next completion or NULL if there is none, it is consumed with `seen_cqe()'.
+ */
+struct io_uring_cqe *peek_cqe(void);
+
+void seen_cqe(void);
+
+/*
+ * Unmap the rings and close the instance, pending requests are canceled by the kernel.
+ */
+void close_uring(void);
+
+
+#endif /* URING_H_ */
@@ -0,0 +1,488 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Deliver alerts to webhook and SMTP sinks served on the loopback interface
+ * and check the delivery:
+ *      batching - a burst of alerts is sent as one message after the batch delay;
+ *      debounce - a single invalid sample does not alert, persistent ones do;
+ *      backoff - failed deliveries are retried with growing delays;
+ *      overflow - alerts which do not fit into the message are dropped whole,
+ *                 the message stays complete;
+ *      flush - pending alerts are delivered on stop without waiting for the batch delay.
+ * The alerts module is built with short delays and a small message for the test.
+ * Exit code is 0 if all checks pass.
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "alerts.h"
+#include "protocol.h"
+
+
+#define MAX_MESSAGES (64)
+#define BODY_SIZE (4096)
+#define TOLERANCE (100)  /* scheduling error of delivery times, milliseconds */
+#define WAIT_TIMEOUT (5000)
+
+
+typedef enum {
+    WEBHOOK,
+    SMTP,
+    SINKS_COUNT
+}
+sink_kind;
+
+
+typedef struct {
+    uint64_t time;  /* monotonic, milliseconds */
+    int failed;  /* the server has refused the message */
+    char body[BODY_SIZE];
+}
+message_t;
+
+
+static const char *sink_names[] = {"webhook", "smtp"};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static message_t messages[SINKS_COUNT][MAX_MESSAGES];  /* protected by the mutex */
+static unsigned int counts[SINKS_COUNT];
+static unsigned int refusals[SINKS_COUNT];  /* amount of next messages to refuse */
+
+static int listen_fds[SINKS_COUNT];
+static unsigned int failures = 0;
+
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+
+    return (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+}
+
+
+static void check(const int ok, const char *scenario, const char *what)
+{
+    if (!ok) {
+        printf("%s: %s failed\n", scenario, what);
+        failures++;
+    }
+}
+
+
+/*
+ * Read from the connection until the buffer contains `end'.
+ * Return the length or 0 on error.
+ */
+static size_t read_until(const int fd, char *buf, const size_t size, size_t len, const char *end)
+{
+    while (strstr(buf, end) == NULL) {
+        const ssize_t count = recv(fd, buf + len, size - 1 - len, 0);
+        if (count <= 0)
+            return 0;
+
+        len += count;
+        buf[len] = '\0';
+    }
+
+    return len;
+}
+
+
+/*
+ * Record the message, the next one of the sink is refused if asked.
+ * Return 1 if the message is refused and 0 otherwise.
+ */
+static int record(const sink_kind sink, const char *body)
+{
+    pthread_mutex_lock(&mutex);
+
+    const int failed = refusals[sink] > 0;
+
+    if (failed)
+        refusals[sink]--;
+
+    if (counts[sink] < MAX_MESSAGES) {
+        message_t *message = &(messages[sink][counts[sink]++]);
+
+        message->time = get_time_ms();
+        message->failed = failed;
+        snprintf(message->body, sizeof(message->body), "%s", body);
+    }
+
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    return failed;
+}
+
+
+static void serve_webhook(const int fd)
+{
+    static char request[BODY_SIZE];
+    size_t len = 0;
+
+    request[0] = '\0';
+
+    if (!(len = read_until(fd, request, sizeof(request), len, "\r\n\r\n")))
+        return;
+
+    const char *length = strstr(request, "Content-Length: ");
+    char *body = strstr(request, "\r\n\r\n") + 4;
+    const size_t body_len = length != NULL ? strtoul(length + 16, NULL, 10) : 0;
+
+    while ((size_t) (request + len - body) < body_len) {
+        const ssize_t count = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (count <= 0)
+            return;
+
+        len += count;
+        request[len] = '\0';
+    }
+
+    const char *reply = record(WEBHOOK, body) ? "HTTP/1.1 500 Internal Server Error\r\n\r\n" : "HTTP/1.1 200 OK\r\n\r\n";
+
+    send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+}
+
+
+static void serve_smtp(const int fd)
+{
+    static char buf[BODY_SIZE];
+    static const char *commands[] = {"HELO ", "MAIL FROM:", "RCPT TO:", "DATA"};
+    static const char *replies[] = {"250 hello\r\n", "250 ok\r\n", "250 ok\r\n", "354 go on\r\n"};
+
+    send(fd, "220 test\r\n", 10, MSG_NOSIGNAL);
+
+    for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        buf[0] = '\0';
+        if (!read_until(fd, buf, sizeof(buf), 0, "\r\n") || strncmp(buf, commands[i], strlen(commands[i])))
+            return;
+        send(fd, replies[i], strlen(replies[i]), MSG_NOSIGNAL);
+    }
+
+    buf[0] = '\0';
+    if (!read_until(fd, buf, sizeof(buf), 0, "\r\n.\r\n"))
+        return;
+
+    const char *reply = record(SMTP, buf) ? "451 try later\r\n" : "250 queued\r\n";
+
+    send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+
+    buf[0] = '\0';
+    if (read_until(fd, buf, sizeof(buf), 0, "\r\n"))
+        send(fd, "221 bye\r\n", 9, MSG_NOSIGNAL);
+}
+
+
+static void *serve(void *arg)
+{
+    struct pollfd fds[SINKS_COUNT];
+
+    (void) arg;
+
+    for (int i = 0; i < SINKS_COUNT; i++) {
+        fds[i].fd = listen_fds[i];
+        fds[i].events = POLLIN;
+    }
+
+    for (;;) {
+        if (poll(fds, SINKS_COUNT, -1) <= 0)
+            continue;
+
+        for (int i = 0; i < SINKS_COUNT; i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+
+            const int fd = accept(listen_fds[i], NULL, NULL);
+            if (fd < 0)
+                continue;
+
+            if (i == WEBHOOK)
+                serve_webhook(fd);
+            else
+                serve_smtp(fd);
+
+            close(fd);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Listen on the loopback interface.
+ * Return the port or 0 on error.
+ */
+static unsigned int listen_loopback(const sink_kind sink)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t len = sizeof(addr);
+
+    listen_fds[sink] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listen_fds[sink] < 0 || bind(listen_fds[sink], (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(listen_fds[sink], 8) || getsockname(listen_fds[sink], (struct sockaddr *) &addr, &len)) {
+        fprintf(stderr, "unable to listen on loopback, error '%m'\n");
+        return 0;
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+
+/*
+ * Wait until both sinks have got `count' messages in total.
+ * Return 0 on success and >0 on timeout.
+ */
+static int wait_messages(const unsigned int count, const unsigned int timeout)
+{
+    const uint64_t deadline = get_time_ms() + timeout;
+    int ret = 0;
+
+    pthread_mutex_lock(&mutex);
+
+    while (counts[WEBHOOK] < count || counts[SMTP] < count) {
+        pthread_mutex_unlock(&mutex);
+
+        if (get_time_ms() >= deadline) {
+            ret = 1;
+            pthread_mutex_lock(&mutex);
+            break;
+        }
+
+        usleep(10000);
+        pthread_mutex_lock(&mutex);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+
+static unsigned int get_count(const sink_kind sink)
+{
+    pthread_mutex_lock(&mutex);
+    const unsigned int count = counts[sink];
+    pthread_mutex_unlock(&mutex);
+
+    return count;
+}
+
+
+static int count_text(const char *text, const char *pattern)
+{
+    int count = 0;
+
+    for (const char *next = text; (next = strstr(next, pattern)) != NULL; next++)
+        count++;
+
+    return count;
+}
+
+
+static void publish(const ups_status status)
+{
+    ups_sample sample = {
+        .input_voltage = status == UPS_OFFLINE ? 0.0f : 229.2f,
+        .fault_voltage = 229.2f,
+        .output_voltage = 229.2f,
+        .load = 14.0f,
+        .frequency = 50.1f,
+        .battery_voltage = 27.6f,
+        .temperature = 25.0f,
+        .flags = status == UPS_OFFLINE ? UPS_FLAG_UTILITY_FAIL : 0
+    };
+
+    publish_alert(0, status, status != INVALID_RESPONSE ? &sample : NULL);
+}
+
+
+static void test_batching(void)
+{
+    const uint64_t start = get_time_ms();
+
+    publish(UPS_OFFLINE);
+    publish(UPS_ONLINE);
+
+    check(!wait_messages(1, WAIT_TIMEOUT), "batching", "delivery");
+    usleep(2 * BATCH_DELAY * 1000);
+
+    for (int i = 0; i < SINKS_COUNT; i++) {
+        const message_t *message = &(messages[i][0]);
+
+        check(get_count(i) == 1, sink_names[i], "one message per burst");
+        check(message->time + TOLERANCE >= start + BATCH_DELAY, sink_names[i], "batch delay");
+    }
+
+    check(strstr(messages[WEBHOOK][0].body, "\"event\":\"offline\"") != NULL &&
+          strstr(messages[WEBHOOK][0].body, "\"event\":\"online\"") != NULL, "batching", "webhook events");
+    check(strstr(messages[SMTP][0].body, "UPS is on battery") != NULL &&
+          strstr(messages[SMTP][0].body, "UPS is online") != NULL, "batching", "mail lines");
+}
+
+
+static void test_debounce(void)
+{
+    publish(UPS_ONLINE);
+    publish(INVALID_RESPONSE);
+    publish(UPS_ONLINE);
+
+    usleep(2 * BATCH_DELAY * 1000);
+    check(get_count(WEBHOOK) == 1 && get_count(SMTP) == 1, "debounce", "no alert of single invalid sample");
+
+    publish(INVALID_RESPONSE);
+    publish(INVALID_RESPONSE);
+    publish(INVALID_RESPONSE);
+    publish(INVALID_RESPONSE);
+    publish(UPS_ONLINE);
+
+    check(!wait_messages(2, WAIT_TIMEOUT), "debounce", "delivery");
+
+    const char *body = messages[WEBHOOK][1].body;
+
+    check(count_text(body, "\"event\":\"invalid\"") == 1 && count_text(body, "\"event\":\"online\"") == 1,
+          "debounce", "one alert of persistent invalid samples");
+}
+
+
+static void test_backoff(void)
+{
+    pthread_mutex_lock(&mutex);
+    refusals[WEBHOOK] = 2;
+    refusals[SMTP] = 2;
+    pthread_mutex_unlock(&mutex);
+
+    publish(UPS_OFFLINE);
+
+    check(!wait_messages(5, WAIT_TIMEOUT), "backoff", "delivery");
+
+    for (int i = 0; i < SINKS_COUNT; i++) {
+        const message_t *first = &(messages[i][2]);
+        const message_t *second = &(messages[i][3]);
+        const message_t *third = &(messages[i][4]);
+
+        check(first->failed && second->failed && !third->failed, sink_names[i], "refused deliveries");
+        check(second->time + TOLERANCE >= first->time + RETRY_DELAY_MIN, sink_names[i], "first retry delay");
+        check(third->time + TOLERANCE >= second->time + 2 * RETRY_DELAY_MIN &&
+              third->time + TOLERANCE >= second->time + RETRY_DELAY_MAX, sink_names[i], "doubled retry delay");
+        check(strstr(third->body, "offline") != NULL || strstr(third->body, "on battery") != NULL,
+              sink_names[i], "retried alert");
+    }
+
+    publish(UPS_ONLINE);
+
+    check(!wait_messages(6, WAIT_TIMEOUT), "backoff", "delivery after retries");
+}
+
+
+static void test_overflow(void)
+{
+    /* a full queue of alerts does not fit into the message */
+    for (int i = 0; i < 16; i++) {
+        publish(UPS_OFFLINE);
+        publish(UPS_ONLINE);
+    }
+
+    check(!wait_messages(7, WAIT_TIMEOUT), "overflow", "delivery");
+
+    const char *body = messages[WEBHOOK][6].body;
+    const size_t len = strlen(body);
+
+    check(strstr(body, "\"dropped\":") != NULL, "overflow", "dropped alerts in webhook message");
+    /* every alert object ends with its flags */
+    check(count_text(body, "{") == count_text(body, "}") && count_text(body, "[") == count_text(body, "]") &&
+          count_text(body, "{\"event\"") == count_text(body, "\"}") && len > 2 && !strcmp(body + len - 2, "}\n"),
+          "overflow", "complete JSON");
+    check(strstr(messages[SMTP][6].body, "more alerts are dropped\r\n.\r\n") != NULL, "overflow", "dropped alerts in mail");
+}
+
+
+static void test_flush(void)
+{
+    const uint64_t start = get_time_ms();
+
+    publish(UPS_OFFLINE);
+    stop_alerts();
+
+    check(get_count(WEBHOOK) == 8 && get_count(SMTP) == 8, "flush", "delivery on stop");
+    check(get_time_ms() < start + BATCH_DELAY, "flush", "no batch delay on stop");
+}
+
+
+int main(void)
+{
+    char path[] = "/tmp/alert_sinks.XXXXXX";
+    pthread_t thread;
+
+    setlogmask(LOG_UPTO(LOG_CRIT));  /* refused deliveries are logged as errors */
+
+    const unsigned int webhook_port = listen_loopback(WEBHOOK);
+    const unsigned int smtp_port = listen_loopback(SMTP);
+    if (!webhook_port || !smtp_port)
+        return EXIT_FAILURE;
+
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "unable to create '%s', error '%m'\n", path);
+        return EXIT_FAILURE;
+    }
+
+    dprintf(fd, "webhook http://127.0.0.1:%u/ups\nsmtp 127.0.0.1:%u ups@example.com admin@example.com\n",
+            webhook_port, smtp_port);
+    close(fd);
+
+    const int ret = load_alerts(path);
+    unlink(path);
+
+    if (ret || pthread_create(&thread, NULL, serve, NULL) || start_alerts()) {
+        fprintf(stderr, "unable to start alerts\n");
+        return EXIT_FAILURE;
+    }
+
+    test_batching();
+    test_debounce();
+    test_backoff();
+    test_overflow();
+    test_flush();
+
+    printf("scenarios: batching, debounce, backoff, overflow, flush; messages: %u webhook, %u smtp\n",
+           get_count(WEBHOOK), get_count(SMTP));
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Benchmark of the event engines: the simulated UPS units answer the status
+ * request on pseudo terminals, the ports are configured as the daemon does
+ * (the response read ends by the inter-character timeout). Every engine sends
+ * the requests to all ports on each timer tick and reads the responses, system
+ * calls of the engine, CPU time of the process (without the simulator) and wall
+ * time are counted per round. The poll() engine reads the ports one by one, each
+ * read waits for the inter-character timeout, so its rounds stretch over several
+ * timer periods with many ports (the timer expirations are coalesced).
+ * Usage: engine_bench [<ROUNDS>]
+ * Exit code is 0 if every engine has got all responses.
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "engine.h"
+#include "port.h"
+#include "protocol.h"
+#include "stats.h"
+
+
+#define DEFAULT_ROUNDS (10)
+#define INTERVAL_MS (250)  /* longer than the response read, it ends 100 ms after the last character */
+#define ONLINE_FRAME ("(229.2 229.2 229.2 014 50.1 27.6 25.0 00001001\r")
+
+
+static const unsigned int ports_counts[] = {1, 16, 64};
+static const char *engines[] = {"poll", "uring"};
+
+static int masters[ENGINE_MAX_PORTS];
+static int slaves[ENGINE_MAX_PORTS];
+static unsigned int ports_count = 0;
+static int stop_fd = -1;
+
+
+/*
+ * Answer every request on the master side of the pseudo terminals until `stop_fd' is readable.
+ */
+static void *simulate(void *arg)
+{
+    struct pollfd fds[1 + ENGINE_MAX_PORTS];
+    char request[64];
+
+    (void) arg;
+
+    fds[0].fd = stop_fd;
+    fds[0].events = POLLIN;
+
+    for (unsigned int i = 0; i < ports_count; i++) {
+        fds[1 + i].fd = masters[i];
+        fds[1 + i].events = POLLIN;
+    }
+
+    for (;;) {
+        if (poll(fds, 1 + ports_count, -1) < 0)
+            continue;
+
+        if (fds[0].revents)
+            break;
+
+        for (unsigned int i = 0; i < ports_count; i++)
+            if (fds[1 + i].revents & POLLIN) {
+                const ssize_t size = read(masters[i], request, sizeof(request));
+
+                for (ssize_t j = 0; j < size; j++)
+                    if (request[j] == '\r')
+                        write(masters[i], ONLINE_FRAME, sizeof(ONLINE_FRAME) - 1);
+            }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Open the pseudo terminals, the slave side is opened and configured as the UPS port.
+ * Return 0 on success and >0 on error.
+ */
+static int open_ports(const unsigned int count)
+{
+    for (ports_count = 0; ports_count < count; ports_count++) {
+        const int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+        if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+            fprintf(stderr, "unable to open pseudo terminal, error '%m'\n");
+            return 1;
+        }
+
+        masters[ports_count] = fd;
+
+        slaves[ports_count] = open_port(ptsname(fd));
+        if (slaves[ports_count] < 0) {
+            fprintf(stderr, "unable to open port %s\n", ptsname(fd));
+            close(fd);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void close_ports(void)
+{
+    for (unsigned int i = 0; i < ports_count; i++) {
+        close(slaves[i]);
+        close(masters[i]);
+    }
+
+    ports_count = 0;
+}
+
+
+static uint64_t get_cpu_ns(const clockid_t clock)
+{
+    struct timespec tm;
+
+    clock_gettime(clock, &tm);
+
+    return (uint64_t) tm.tv_sec * 1000000000 + tm.tv_nsec;
+}
+
+
+/*
+ * Run the engine for the given amount of rounds on the open ports.
+ * Return 0 if all responses are valid and >0 otherwise.
+ */
+static int run_engine(const char *name, const unsigned int rounds)
+{
+    engine_event events[ENGINE_MAX_EVENTS];
+    ups_sample sample;
+    pthread_t thread;
+    clockid_t thread_clock;
+    unsigned int responses = 0, missed = 0, ticks = 0;
+    uint64_t syscalls = 0, cpu_ns = 0, thread_ns = 0, wall_ns = 0;
+
+    const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    const struct itimerspec tm = {
+        .it_interval = {.tv_sec = 0, .tv_nsec = INTERVAL_MS * 1000000},
+        .it_value = {.tv_sec = 0, .tv_nsec = INTERVAL_MS * 1000000}
+    };
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    if (timer_fd < 0 || stop_fd < 0 || timerfd_settime(timer_fd, 0, &tm, NULL)) {
+        fprintf(stderr, "unable to create descriptors, error '%m'\n");
+        return 1;
+    }
+
+    /* the signal descriptor of the daemon is replaced by the never readable event descriptor */
+    if (open_engine(name, stop_fd, timer_fd, slaves, ports_count, INTERVAL_MS))
+        return 1;
+
+    pthread_create(&thread, NULL, simulate, NULL);
+    pthread_getcpuclockid(thread, &thread_clock);
+
+    /* the last tick collects the responses of the last round only */
+    while (ticks <= rounds) {
+        const int count = wait_events(-1, events);
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].type == ENGINE_RESPONSE) {
+                if (decode_response(slaves[events[i].port], events[i].response, events[i].size, &sample) == UPS_ONLINE)
+                    responses++;
+            }
+            else if (events[i].type == ENGINE_TIMER) {
+                if (!ticks++) {
+                    syscalls = stats.syscalls;
+                    cpu_ns = get_cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+                    thread_ns = get_cpu_ns(thread_clock);
+                    wall_ns = get_time_ns();
+                }
+
+                for (unsigned int j = 0; j < ports_count; j++) {
+                    missed += is_response_awaited(j);
+                    if (ticks <= rounds && send_port_request(j, DEFAULT_REQUEST))
+                        missed++;
+                }
+            }
+        }
+    }
+
+    wall_ns = get_time_ns() - wall_ns;
+    syscalls = stats.syscalls - syscalls;
+    cpu_ns = get_cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns - (get_cpu_ns(thread_clock) - thread_ns);
+
+    printf("%5u  %-6s  %6u  %9u  %6u  %14.1f  %12.1f  %8.1f\n", ports_count, get_engine_name(), rounds, responses, missed,
+           (double) syscalls / rounds, (double) cpu_ns / rounds / 1000, (double) wall_ns / rounds / 1000000);
+
+    eventfd_write(stop_fd, 1);
+    pthread_join(thread, NULL);
+
+    close_engine();
+    close(timer_fd);
+    close(stop_fd);
+
+    return responses != rounds * ports_count;
+}
+
+
+int main(int argc, char **argv)
+{
+    const unsigned int rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ROUNDS;
+    int failures = 0;
+
+    if (!rounds)
+        return EXIT_FAILURE;
+
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    setvbuf(stdout, NULL, _IOLBF, 0);  /* show the results as they come */
+
+    printf("ports  engine  rounds  responses  missed  syscalls/round  cpu us/round  ms/round\n");
+
+    for (unsigned int i = 0; i < sizeof(ports_counts) / sizeof(ports_counts[0]); i++) {
+        if (open_ports(ports_counts[i])) {
+            close_ports();
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned int j = 0; j < sizeof(engines) / sizeof(engines[0]); j++)
+            failures += run_engine(engines[j], rounds);
+
+        close_ports();
+    }
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
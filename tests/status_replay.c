@@ -0,0 +1,343 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replay scripted sample sequences through the status machine in virtual time
+ * (milliseconds) and check every decision against a reference model:
+ *      flaps - UPS status changes every few samples;
+ *      long outages - offline for several shutdown delays with invalid responses;
+ *      recovery - UPS becomes online 1 ms before the deadline;
+ *      deadline - the sample comes exactly at the deadline;
+ *      restart - the daemon is restarted during the outage, the outage is resumed
+ *                only if the restart is short, e.g. not after a new outage;
+ *      random - random statuses, intervals and clock errors.
+ * Usage: status_replay [<SEQUENCES> [<SEED>]]
+ * Exit code is 0 if all decisions match, the decision cost is printed as a benchmark.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <inttypes.h>
+
+#include "protocol.h"
+#include "status.h"
+
+
+#define DEFAULT_SEQUENCES (5000)
+#define DEFAULT_SEED (1)
+#define MAX_FAILURES (10)  /* amount of mismatches printed */
+
+
+typedef enum {
+    SCENARIO_FLAPS,
+    SCENARIO_LONG_OUTAGE,
+    SCENARIO_RECOVERY,
+    SCENARIO_DEADLINE,
+    SCENARIO_RESTART,
+    SCENARIO_RANDOM,
+    SCENARIOS_COUNT
+}
+scenario_type;
+
+
+static const char *scenario_names[SCENARIOS_COUNT] = {
+    "flaps",
+    "long outage",
+    "recovery",
+    "deadline",
+    "restart",
+    "random"
+};
+
+
+/* virtual clock and action sink */
+static uint64_t now = 0;
+static int clock_failed = 0;
+static unsigned int shutdowns = 0;
+static int actions_offline = 0;
+static uint64_t actions_offline_ms = 0;
+
+/* reference model */
+static uint64_t model_since = 0;
+
+static unsigned int seed = DEFAULT_SEED;
+static unsigned int failures = 0;
+static uint64_t decisions = 0;
+static uint64_t decisions_ns = 0;
+
+
+static uint64_t get_virtual_time(void)
+{
+    return clock_failed ? 0 : now;
+}
+
+
+static void record_actions(const ups_sample *sample, const int offline, const uint64_t offline_ms)
+{
+    (void) sample;
+
+    actions_offline = offline;
+    actions_offline_ms = offline_ms;
+}
+
+
+static int record_shutdown(void)
+{
+    shutdowns++;
+    return 0;
+}
+
+
+static const status_ops virtual_status_ops = {
+    .get_time = get_virtual_time,
+    .update_actions = record_actions,
+    .shutdown = record_shutdown
+};
+
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+
+    return (uint64_t) tm.tv_sec * 1000000000 + tm.tv_nsec;
+}
+
+
+static unsigned int random_range(const unsigned int min, const unsigned int max)
+{
+    return min + rand_r(&seed) % (max - min + 1);
+}
+
+
+static void fail(const unsigned int sequence, const char *message, const int expected, const int got)
+{
+    if (++failures <= MAX_FAILURES)
+        fprintf(stderr, "sequence #%u at %" PRIu64 " ms: %s, expected %d, got %d\n",
+                sequence, now, message, expected, got);
+}
+
+
+/*
+ * Feed one sample to the status machine and to the model and compare them.
+ * Return 1 if the shutdown has been run.
+ */
+static int feed_sample(const unsigned int sequence, status_machine *machine, const ups_status status)
+{
+    static const ups_sample sample;
+    int expected = -1;
+    int expected_shutdown = 0;
+
+    /* the model of the decision logic */
+    if (status == UPS_ONLINE) {
+        model_since = 0;
+        expected = 1;
+    }
+    else if (status == UPS_OFFLINE && !clock_failed) {
+        if (!model_since) {
+            model_since = now;
+            expected = 1;
+        }
+        else if (now - model_since < machine->delay)
+            expected = 1;
+        else {
+            model_since = 0;
+            expected = 0;
+            expected_shutdown = 1;
+        }
+    }
+
+    const unsigned int shutdowns_before = shutdowns;
+    const uint64_t start = get_time_ns();
+    const int ret = update_state(machine, status, status != INVALID_RESPONSE ? &sample : NULL);
+
+    decisions_ns += get_time_ns() - start;
+    decisions++;
+
+    const int shutdown = shutdowns != shutdowns_before;
+
+    if (ret != expected)
+        fail(sequence, "unexpected decision", expected, ret);
+
+    if (shutdown != expected_shutdown)
+        fail(sequence, "unexpected shutdown", expected_shutdown, shutdown);
+
+    if (machine->offline_since != model_since)
+        fail(sequence, "unexpected outage start", (int) model_since, (int) machine->offline_since);
+
+    if (status == UPS_OFFLINE && expected > 0 && actions_offline_ms != now - model_since)
+        fail(sequence, "unexpected time offline for actions", (int) (now - model_since), (int) actions_offline_ms);
+
+    if (status == UPS_ONLINE && (actions_offline || actions_offline_ms))
+        fail(sequence, "actions are not reverted", 0, actions_offline);
+
+    return shutdown;
+}
+
+
+/*
+ * Generate and replay one sequence of the given scenario.
+ */
+static void replay_sequence(const unsigned int sequence, const scenario_type scenario)
+{
+    status_machine machine;
+    unsigned int sequence_shutdowns = 0;
+
+    init_status(&machine, &virtual_status_ops, random_range(1, 60) * 60);
+
+    now = random_range(1, 1000000);
+    clock_failed = 0;
+    model_since = 0;
+    actions_offline = 0;
+    actions_offline_ms = 0;
+
+    const uint64_t delay = machine.delay;
+
+    switch (scenario) {
+        case SCENARIO_FLAPS:
+            for (unsigned int i = 0; i < 500; i++) {
+                const ups_status status = (i / random_range(1, 3)) % 2 ? UPS_OFFLINE : UPS_ONLINE;
+                sequence_shutdowns += feed_sample(sequence, &machine, status);
+                now += random_range(500, 5000);
+            }
+            if (sequence_shutdowns)
+                fail(sequence, "shutdown on flaps", 0, sequence_shutdowns);
+            break;
+
+        case SCENARIO_LONG_OUTAGE: {
+            const uint64_t end = now + delay * random_range(1, 5) + random_range(0, 60000);
+            const unsigned int interval = random_range(1000, 60000);
+
+            feed_sample(sequence, &machine, UPS_ONLINE);
+            while (now < end) {
+                now += interval;
+                sequence_shutdowns += feed_sample(sequence, &machine,
+                                                  random_range(0, 9) ? UPS_OFFLINE : INVALID_RESPONSE);
+            }
+            feed_sample(sequence, &machine, UPS_ONLINE);
+            break;
+        }
+
+        case SCENARIO_RECOVERY:
+            feed_sample(sequence, &machine, UPS_OFFLINE);
+            now += delay - 1;
+            sequence_shutdowns += feed_sample(sequence, &machine, UPS_OFFLINE);
+            sequence_shutdowns += feed_sample(sequence, &machine, UPS_ONLINE);
+            now += 1;
+            sequence_shutdowns += feed_sample(sequence, &machine, UPS_OFFLINE);
+            if (sequence_shutdowns)
+                fail(sequence, "shutdown on recovery 1 ms before deadline", 0, sequence_shutdowns);
+            break;
+
+        case SCENARIO_DEADLINE:
+            feed_sample(sequence, &machine, UPS_OFFLINE);
+            now += delay - 1;
+            sequence_shutdowns += feed_sample(sequence, &machine, UPS_OFFLINE);
+            now += 1;
+            sequence_shutdowns += feed_sample(sequence, &machine, UPS_OFFLINE);
+            if (sequence_shutdowns != 1)
+                fail(sequence, "shutdowns at deadline", 1, sequence_shutdowns);
+            break;
+
+        case SCENARIO_RESTART: {
+            const uint64_t interval = random_range(1, 60) * 1000;
+
+            feed_sample(sequence, &machine, UPS_ONLINE);
+            now += interval;
+            feed_sample(sequence, &machine, UPS_OFFLINE);
+            for (unsigned int i = random_range(0, 5); i > 0 && now + interval - model_since < delay; i--) {
+                now += interval;
+                feed_sample(sequence, &machine, UPS_OFFLINE);
+            }
+
+            /* the daemon is stopped, the saved state is restored after the restart */
+            const uint64_t offline_since = machine.offline_since;
+            const uint64_t last_sample = now;
+            const uint64_t gap = random_range(1, 2 * (interval + RESUME_GAP_MS));
+            const int resumable = gap <= interval + RESUME_GAP_MS;
+
+            init_status(&machine, &virtual_status_ops, delay / 1000);
+            now += gap;
+
+            const int resumed = resume_outage(&machine, offline_since, last_sample, interval);
+
+            if (resumed != resumable)
+                fail(sequence, "unexpected outage resume", resumable, resumed);
+
+            model_since = resumed ? offline_since : 0;
+
+            /* the long restart may hide the power return and a new outage */
+            const uint64_t outage_start = model_since ? model_since : now;
+
+            while (!sequence_shutdowns && now - outage_start < 2 * delay) {
+                sequence_shutdowns += feed_sample(sequence, &machine, UPS_OFFLINE);
+                now += interval;
+            }
+
+            if (sequence_shutdowns != 1)
+                fail(sequence, "shutdowns after restart", 1, sequence_shutdowns);
+            break;
+        }
+
+        case SCENARIO_RANDOM:
+            for (unsigned int i = 0; i < 1000; i++) {
+                const unsigned int dice = random_range(0, 99);
+                const ups_status status = dice < 60 ? UPS_OFFLINE : dice < 95 ? UPS_ONLINE : INVALID_RESPONSE;
+
+                clock_failed = !random_range(0, 99);
+                feed_sample(sequence, &machine, status);
+                now += random_range(1, 120000);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    const unsigned int sequences = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_SEQUENCES;
+
+    if (argc > 2)
+        seed = strtoul(argv[2], NULL, 10);
+
+    const unsigned int first_seed = seed;
+
+    setlogmask(LOG_UPTO(LOG_ERR));  /* transitions are logged at info level */
+
+    for (unsigned int i = 0; i < sequences; i++)
+        replay_sequence(i, (scenario_type) (i % SCENARIOS_COUNT));
+
+    printf("sequences: %u (", sequences);
+    for (int i = 0; i < SCENARIOS_COUNT; i++)
+        printf("%s%s", i ? ", " : "", scenario_names[i]);
+    printf("), seed %u\n", first_seed);
+
+    printf("decisions: %" PRIu64 ", shutdowns: %u, failures: %u\n", decisions, shutdowns, failures);
+    printf("decision cost: %.1f ns\n", decisions ? (double) decisions_ns / decisions : 0.0);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
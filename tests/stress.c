@@ -0,0 +1,351 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Stress test: run the daemon built with fault injection against a simulated UPS
+ * on a pseudo terminal, switch the UPS offline for a while periodically and check
+ * the daemon log. The outages are shorter than the shutdown delay, so any shutdown
+ * is false. `shutdown' is replaced by a script which does nothing.
+ *
+ * Usage: stress <DAEMON> <SECONDS>
+ * Fault schedule is taken from FSPUPSMON_FAULTS, the default one is used if it is not set.
+ * Exit code is 0 if there are no false shutdowns, all outages are detected
+ * and the daemon exits cleanly.
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+#define DEFAULT_FAULTS ("seed=1,delay=0.01,delay_ms=1500,truncate=0.02,split=0.02,flip=0.01,eio=0.01,eagain=0.01,hangup=0.005")
+#define FIRST_OUTAGE_MS (10000)  /* time of the first outage since start */
+#define OUTAGE_PERIOD_MS (40000)  /* UPS goes offline every period */
+#define OUTAGE_MS (15000)  /* outage duration, less than the shutdown delay */
+#define LINE_SIZE (512)
+#define REQUEST_SIZE (16)
+
+#define ONLINE_FRAME ("(229.2 229.2 229.2 014 50.1 27.6 25.0 00001001\r")
+#define OFFLINE_FRAME ("(012.3 229.7 220.2 014 50.1 24.6 25.0 10001001\r")
+
+
+typedef struct {
+    unsigned int outages, detected, undetected;
+    uint64_t latency_total, latency_max;  /* from the outage start to its detection, ms */
+    unsigned int false_offline;  /* offline detected while the UPS is online */
+    unsigned int false_shutdowns;
+    unsigned int invalid, missed;  /* reported by the daemon at exit */
+    char faults[LINE_SIZE];  /* amounts of injected faults reported by the daemon */
+}
+results_t;
+
+
+static results_t results;
+static int offline = 0;  /* the simulated UPS is offline */
+static int detected = 0;  /* the current outage has been detected */
+static uint64_t outage_start = 0;
+
+
+static uint64_t get_time_ms(void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+
+    return (uint64_t) tm.tv_sec * 1000 + tm.tv_nsec / 1000000;
+}
+
+
+/*
+ * Create the directory with the fake `shutdown'.
+ * Return 0 on success and >0 on error.
+ */
+static int make_bin_dir(char *dir)
+{
+    char path[256];
+
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "unable to create directory '%s', error '%m'\n", dir);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/shutdown", dir);
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "unable to create '%s', error '%m'\n", path);
+        return 1;
+    }
+
+    fputs("#!/bin/sh\nexit 0\n", file);
+    fclose(file);
+
+    return chmod(path, 0755) != 0;
+}
+
+
+static void remove_bin_dir(const char *dir)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/shutdown", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+
+/*
+ * Start the daemon on the port with stderr redirected to the log pipe.
+ * Return its pid or -1 on error.
+ */
+static pid_t start_daemon(const char *daemon, const char *port, const char *bin_dir, const int log_fd)
+{
+    char path[1024];
+
+    const pid_t pid = fork();
+
+    if (pid)
+        return pid;
+
+    snprintf(path, sizeof(path), "%s:%s", bin_dir, getenv("PATH") != NULL ? getenv("PATH") : "/usr/bin:/bin");
+    setenv("PATH", path, 1);
+    setenv("FSPUPSMON_FAULTS", DEFAULT_FAULTS, 0);
+
+    dup2(log_fd, STDERR_FILENO);
+    execl(daemon, daemon, "-d", "-i", "1", "-s", "1", "-p", port, (char*) NULL);
+    fprintf(stderr, "unable to execute '%s', error '%m'\n", daemon);
+    _exit(127);
+}
+
+
+/*
+ * Answer status requests of the daemon according to the simulated UPS status.
+ */
+static void serve_port(const int master_fd, char *request, size_t *request_size)
+{
+    char buf[64];
+
+    const ssize_t size = read(master_fd, buf, sizeof(buf));
+
+    for (ssize_t i = 0; i < size; i++) {
+        if (buf[i] != '\r') {
+            if (*request_size < REQUEST_SIZE - 1)
+                request[(*request_size)++] = buf[i];
+            continue;
+        }
+
+        request[*request_size] = '\0';
+        *request_size = 0;
+
+        if (strcmp(request, "QS") && strcmp(request, "Q1"))
+            continue;
+
+        const char *frame = offline ? OFFLINE_FRAME : ONLINE_FRAME;
+
+        if (write(master_fd, frame, strlen(frame)) < 0)
+            fprintf(stderr, "unable to write response, error '%m'\n");
+    }
+}
+
+
+static void check_line(const char *line)
+{
+    const char *found;
+
+    if (strstr(line, "UPS became offline") != NULL) {
+        if (!offline)
+            results.false_offline++;
+        else if (!detected) {
+            const uint64_t latency = get_time_ms() - outage_start;
+
+            detected = 1;
+            results.detected++;
+            results.latency_total += latency;
+            if (latency > results.latency_max)
+                results.latency_max = latency;
+        }
+    }
+    else if (strstr(line, "shutdown delay is over") != NULL)
+        results.false_shutdowns++;
+    else if ((found = strstr(line, "invalid responses=")) != NULL)
+        sscanf(found, "invalid responses=%u, missed samples=%u", &results.invalid, &results.missed);
+    else if ((found = strstr(line, "faults: ")) != NULL)
+        snprintf(results.faults, sizeof(results.faults), "%s", found + 8);
+}
+
+
+/*
+ * Split the daemon log into lines and check them.
+ * Return 0 on success and >0 on EOF or error.
+ */
+static int read_log(const int log_fd, char *line, size_t *line_size)
+{
+    char buf[1024];
+
+    const ssize_t size = read(log_fd, buf, sizeof(buf));
+    if (size <= 0)
+        return size == 0 || errno != EINTR;
+
+    for (ssize_t i = 0; i < size; i++) {
+        if (buf[i] != '\n') {
+            if (*line_size < LINE_SIZE - 1)
+                line[(*line_size)++] = buf[i];
+            continue;
+        }
+
+        line[*line_size] = '\0';
+        *line_size = 0;
+        check_line(line);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Switch the simulated UPS according to the outage schedule.
+ */
+static void switch_ups(const uint64_t elapsed)
+{
+    const int should_be_offline = elapsed >= FIRST_OUTAGE_MS
+                                  && (elapsed - FIRST_OUTAGE_MS) % OUTAGE_PERIOD_MS < OUTAGE_MS;
+
+    if (should_be_offline == offline)
+        return;
+
+    offline = should_be_offline;
+
+    if (offline) {
+        results.outages++;
+        outage_start = get_time_ms();
+        detected = 0;
+    }
+    else if (!detected)
+        results.undetected++;
+}
+
+
+int main(int argc, char **argv)
+{
+    char bin_dir[] = "/tmp/fspupsmon-stress.XXXXXX";
+    char request[REQUEST_SIZE];
+    size_t request_size = 0;
+    char line[LINE_SIZE];
+    size_t line_size = 0;
+    int log_fds[2];
+    int status = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <DAEMON> <SECONDS>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t duration = strtoull(argv[2], NULL, 10) * 1000;
+
+    const int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master_fd < 0 || grantpt(master_fd) || unlockpt(master_fd)) {
+        fprintf(stderr, "unable to open pseudo terminal, error '%m'\n");
+        return EXIT_FAILURE;
+    }
+
+    if (make_bin_dir(bin_dir))
+        return EXIT_FAILURE;
+
+    if (pipe2(log_fds, O_CLOEXEC)) {
+        fprintf(stderr, "unable to create pipe, error '%m'\n");
+        remove_bin_dir(bin_dir);
+        return EXIT_FAILURE;
+    }
+
+    const char *port = ptsname(master_fd);
+    const char *faults = getenv("FSPUPSMON_FAULTS");
+
+    printf("stress test of '%s' for %" PRIu64 " s on %s, faults '%s'\n",
+           argv[1], duration / 1000, port, faults != NULL ? faults : DEFAULT_FAULTS);
+    fflush(stdout);
+
+    const pid_t pid = start_daemon(argv[1], port, bin_dir, log_fds[1]);
+    close(log_fds[1]);
+
+    if (pid < 0) {
+        fprintf(stderr, "unable to fork, error '%m'\n");
+        remove_bin_dir(bin_dir);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t start = get_time_ms();
+    int stopped = 0;
+
+    for (;;) {
+        const uint64_t elapsed = get_time_ms() - start;
+
+        if (elapsed >= duration && !stopped) {
+            kill(pid, SIGINT);
+            stopped = 1;
+        }
+
+        switch_ups(elapsed);
+
+        struct pollfd fds[2] = {
+            {.fd = log_fds[0], .events = POLLIN},
+            {.fd = master_fd, .events = POLLIN}
+        };
+
+        if (poll(fds, 2, 100) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() return error '%m'\n");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            serve_port(master_fd, request, &request_size);
+
+        if ((fds[0].revents & (POLLIN | POLLHUP)) && read_log(log_fds[0], line, &line_size))
+            break;
+    }
+
+    waitpid(pid, &status, 0);
+    remove_bin_dir(bin_dir);
+
+    printf("outages: %u, detected: %u, undetected: %u\n", results.outages, results.detected, results.undetected);
+    printf("detection latency: avg %" PRIu64 " ms, max %" PRIu64 " ms\n",
+           results.detected ? results.latency_total / results.detected : 0, results.latency_max);
+    printf("false offline detections: %u, false shutdowns: %u\n", results.false_offline, results.false_shutdowns);
+    printf("invalid responses: %u, missed samples: %u\n", results.invalid, results.missed);
+    printf("injected faults: %s\n", results.faults);
+
+    if (!stopped)
+        printf("daemon exited before the end of the test, status 0x%X\n", status);
+
+    const int failed = !stopped || !WIFEXITED(status) || WEXITSTATUS(status)
+                       || results.false_shutdowns || results.undetected;
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,404 @@
+/*
+    This file is part of fspupsmon.
+
+    Copyright (C) 2016 Vadim Kuznetsov <vimusov@gmail.com>
+
+    fspupsmon is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    fspupsmon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with fspupsmon.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+
+typedef struct {
+    const char *data;  /* mapped file */
+    size_t size;  /* size of the mapping */
+    size_t record_size;  /* size of each record */
+    size_t count;  /* amount of records */
+}
+history_map;
+
+
+static const char *rollup_names[ROLLUP_VALUES_COUNT] = {
+    "input_voltage",
+    "output_voltage",
+    "battery_voltage",
+    "load",
+    "temperature"
+};
+
+
+/*
+ * Map the history file into memory and validate its header.
+ * Return 0 on success and >0 on error.
+ */
+static int map_history(const char *path, const size_t record_size, history_map *map)
+{
+    struct stat st;
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: unable to open '%s': %m\n", path);
+        return 1;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(history_header)) {
+        fprintf(stderr, "Error: '%s' is not a history file\n", path);
+        close(fd);
+        return 1;
+    }
+
+    map->size = st.st_size;
+    map->data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map->data == MAP_FAILED) {
+        fprintf(stderr, "Error: unable to map '%s': %m\n", path);
+        return 1;
+    }
+
+    const history_header *header = (const history_header*) map->data;
+
+    if (header->magic != HISTORY_MAGIC || header->version != HISTORY_VERSION || header->record_size != record_size) {
+        fprintf(stderr, "Error: '%s' has invalid header\n", path);
+        munmap((void*) map->data, map->size);
+        return 1;
+    }
+
+    map->record_size = record_size;
+    map->count = (map->size - sizeof(history_header)) / record_size;
+
+    return 0;
+}
+
+
+/*
+ * Return the time of the record with the given index (every record starts with it).
+ */
+static uint64_t record_time(const history_map *map, const size_t index)
+{
+    uint64_t time;
+
+    memcpy(&time, map->data + sizeof(history_header) + index * map->record_size, sizeof(time));
+
+    return time;
+}
+
+
+/*
+ * Return index of the first record with time not less than the given one.
+ */
+static size_t find_record(const history_map *map, const uint64_t time)
+{
+    size_t low = 0;
+    size_t high = map->count;
+
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+
+        if (record_time(map, middle) < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+
+/*
+ * Parse time as seconds since Epoch or as local 'YYYY-MM-DD[ HH:MM[:SS]]'.
+ * Return time in milliseconds or UINT64_MAX on error.
+ */
+static uint64_t parse_time(const char *value)
+{
+    struct tm tm;
+    char *end = NULL;
+
+    const unsigned long long seconds = strtoull(value, &end, 10);
+    if (*value && end != NULL && !*end)
+        return (uint64_t) seconds * 1000;
+
+    static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_isdst = -1;
+
+        end = strptime(value, formats[i], &tm);
+        if (end != NULL && !*end) {
+            const time_t t = mktime(&tm);
+            if (t >= 0)
+                return (uint64_t) t * 1000;
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+
+/*
+ * Print the value, NAN is printed as an empty CSV field or JSON null.
+ */
+static void print_value(const char *name, const float value, const int json)
+{
+    if (json) {
+        if (isnan(value))
+            printf(",\"%s\":null", name);
+        else
+            printf(",\"%s\":%.2f", name, value);
+    }
+    else {
+        if (isnan(value))
+            printf(",");
+        else
+            printf(",%.2f", value);
+    }
+}
+
+
+static void print_time(const uint64_t time, const int json)
+{
+    if (json)
+        printf("{\"time\":%" PRIu64 ".%03" PRIu64, time / 1000, time % 1000);
+    else
+        printf("%" PRIu64 ".%03" PRIu64, time / 1000, time % 1000);
+}
+
+
+static void print_samples(const history_map *map, const uint64_t from, const uint64_t to, const int json)
+{
+    if (!json)
+        printf("time,input_voltage,fault_voltage,output_voltage,load,frequency,battery_voltage,temperature,flags\n");
+
+    for (size_t i = find_record(map, from); i < map->count; i++) {
+        history_sample sample;
+
+        memcpy(&sample, map->data + sizeof(history_header) + i * map->record_size, sizeof(sample));
+        if (sample.time >= to)
+            break;
+
+        print_time(sample.time, json);
+        print_value("input_voltage", sample.input_voltage, json);
+        print_value("fault_voltage", sample.fault_voltage, json);
+        print_value("output_voltage", sample.output_voltage, json);
+        print_value("load", sample.load, json);
+        print_value("frequency", sample.frequency, json);
+        print_value("battery_voltage", sample.battery_voltage, json);
+        print_value("temperature", sample.temperature, json);
+
+        if (json)
+            printf(",\"flags\":\"%02" PRIX32 "\"}\n", sample.flags);
+        else
+            printf(",%02" PRIX32 "\n", sample.flags);
+    }
+}
+
+
+/*
+ * Merge the rollup into the accumulated one.
+ */
+static void merge_rollup(history_rollup *dst, const history_rollup *src)
+{
+    dst->samples += src->samples;
+    dst->offline += src->offline;
+
+    for (int i = 0; i < ROLLUP_VALUES_COUNT; i++) {
+        rollup_stats *d = &(dst->values[i]);
+        const rollup_stats *s = &(src->values[i]);
+
+        if (!s->count)
+            continue;
+
+        if (!d->count || s->min < d->min)
+            d->min = s->min;
+        if (!d->count || s->max > d->max)
+            d->max = s->max;
+        d->sum += s->sum;
+        d->count += s->count;
+    }
+}
+
+
+static void print_rollup(const history_rollup *rollup, const int json)
+{
+    char name[64];
+
+    print_time(rollup->time, json);
+
+    if (json)
+        printf(",\"samples\":%" PRIu32 ",\"offline\":%" PRIu32, rollup->samples, rollup->offline);
+    else
+        printf(",%" PRIu32 ",%" PRIu32, rollup->samples, rollup->offline);
+
+    for (int i = 0; i < ROLLUP_VALUES_COUNT; i++) {
+        const rollup_stats *stats = &(rollup->values[i]);
+
+        snprintf(name, sizeof(name), "%s_min", rollup_names[i]);
+        print_value(name, stats->count ? stats->min : NAN, json);
+        snprintf(name, sizeof(name), "%s_max", rollup_names[i]);
+        print_value(name, stats->count ? stats->max : NAN, json);
+        snprintf(name, sizeof(name), "%s_avg", rollup_names[i]);
+        print_value(name, stats->count ? stats->sum / stats->count : NAN, json);
+    }
+
+    printf(json ? "}\n" : "\n");
+}
+
+
+/*
+ * Print rollups, records of the same period (written on daemon restarts) are merged.
+ */
+static void print_rollups(const history_map *map, const uint64_t from, const uint64_t to, const int json)
+{
+    int pending = 0;
+    history_rollup current;
+
+    if (!json) {
+        printf("time,samples,offline");
+        for (int i = 0; i < ROLLUP_VALUES_COUNT; i++)
+            printf(",%s_min,%s_max,%s_avg", rollup_names[i], rollup_names[i], rollup_names[i]);
+        printf("\n");
+    }
+
+    for (size_t i = find_record(map, from); i < map->count; i++) {
+        history_rollup rollup;
+
+        memcpy(&rollup, map->data + sizeof(history_header) + i * map->record_size, sizeof(rollup));
+        if (rollup.time >= to)
+            break;
+
+        if (pending && rollup.time == current.time) {
+            merge_rollup(&current, &rollup);
+            continue;
+        }
+
+        if (pending)
+            print_rollup(&current, json);
+
+        current = rollup;
+        pending = 1;
+    }
+
+    if (pending)
+        print_rollup(&current, json);
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt;
+    int json = 0;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    const char *path = NULL;
+    const char *resolution = "raw";
+    char name[PATH_MAX];
+    history_map map;
+
+    while ((opt = getopt(argc, argv, "hje:f:r:s:")) > 0)
+        switch (opt) {
+            case 'j':
+                json = 1;
+                break;
+
+            case 'e':
+                to = parse_time(optarg);
+                if (to == UINT64_MAX) {
+                    fprintf(stderr, "Error: Invalid end time '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'f':
+                path = optarg;
+                break;
+
+            case 'r':
+                resolution = optarg;
+                break;
+
+            case 's':
+                from = parse_time(optarg);
+                if (from == UINT64_MAX) {
+                    fprintf(stderr, "Error: Invalid start time '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            default:
+                printf(
+                    "Usage: fspupsmon-history [-h] [-j] [-r raw|minute|hour] [-s <TIME>] [-e <TIME>] -f <FILE>\n"
+                    "Arguments:\n"
+                    "    -h: show this help;\n"
+                    "    -j: print JSON lines instead of CSV;\n"
+                    "    -r: print raw samples or per minute/hour rollups (default raw);\n"
+                    "    -s <TIME>: start time, inclusive;\n"
+                    "    -e <TIME>: end time, exclusive;\n"
+                    "    -f <FILE>: history file given to fspupsmon;\n"
+                    "Time is seconds since Epoch or local 'YYYY-MM-DD[ HH:MM[:SS]]'.\n"
+                );
+                return EXIT_FAILURE;
+        }
+
+    if (path == NULL) {
+        fprintf(stderr, "Error: History file is not specified\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *suffix = NULL;
+    size_t record_size = sizeof(history_rollup);
+
+    if (!strcmp(resolution, "raw")) {
+        suffix = "";
+        record_size = sizeof(history_sample);
+    }
+    else if (!strcmp(resolution, "minute"))
+        suffix = HISTORY_MINUTE_SUFFIX;
+    else if (!strcmp(resolution, "hour"))
+        suffix = HISTORY_HOUR_SUFFIX;
+    else {
+        fprintf(stderr, "Error: Invalid resolution '%s'\n", resolution);
+        return EXIT_FAILURE;
+    }
+
+    if (snprintf(name, sizeof(name), "%s%s", path, suffix) >= (int) sizeof(name)) {
+        fprintf(stderr, "Error: History file name '%s' is too long\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (map_history(name, record_size, &map))
+        return EXIT_FAILURE;
+
+    if (record_size == sizeof(history_sample))
+        print_samples(&map, from, to, json);
+    else
+        print_rollups(&map, from, to, json);
+
+    munmap((void*) map.data, map.size);
+
+    return EXIT_SUCCESS;
+}